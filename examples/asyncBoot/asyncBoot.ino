@@ -0,0 +1,86 @@
+// Bring the network up in the background and post as soon as it can.
+// dhcpStart() returns at once; packetLoop() obtains the lease, looks up
+// the gateway and sends the DNS query queued in setup() right after.
+// Network events report each step.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+#define REQUEST_RATE 5000 // milliseconds
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+// remote website name
+const char website[] PROGMEM = "www.google.com";
+
+byte Ethernet::buffer[500];
+static uint32_t timer;
+static bool ready, resolved;
+
+// called from packetLoop() as the network comes up or goes away
+static void net_cb (byte event) {
+  Serial.print(millis());
+  switch (event) {
+  case NET_ADDRESS:
+    // without a DHCP server a link-local address is claimed meanwhile
+    Serial.println(ether.isLinkLocal() ? F(" ms: link-local address") : F(" ms: address"));
+    ether.printIp("IP:  ", ether.myip);
+    ether.printIp("GW:  ", ether.gwip);
+    ether.printIp("DNS: ", ether.dnsip);
+    break;
+  case NET_READY:
+    Serial.println(F(" ms: ready"));
+    ready = true;
+    break;
+  case NET_LOST:
+    Serial.println(F(" ms: lease lost"));
+    ready = false;
+    break;
+  }
+}
+
+// called from packetLoop() when the query is done
+static void dns_cb (byte status, const byte *ip) {
+  if (status == DNS_OK) {
+    Serial.print(millis());
+    ether.printIp(" ms: server ", ip);
+    ether.copyIp(ether.hisip, ip);
+    resolved = true;
+  } else {
+    Serial.print(F("DNS failed, status "));
+    Serial.println(status);
+  }
+}
+
+// called when the client request is complete
+static void my_result_cb (byte status, word off, word len) {
+  Serial.print(F("<<< reply "));
+  Serial.print(millis() - timer);
+  Serial.println(F(" ms"));
+  Serial.println((const char*) Ethernet::buffer + off);
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[asyncBoot]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+
+  ether.registerNetworkCallback(net_cb);
+  ether.dhcpStart();
+  // sent once the address and the route to the DNS server are known
+  ether.dnsResolve(website, dns_cb);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+
+  if (ready && resolved && millis() - timer >= REQUEST_RATE) {
+    timer = millis();
+    Serial.println(F("\n>>> REQ"));
+    ether.browseUrl(PSTR("/"), "", website, my_result_cb);
+  }
+}
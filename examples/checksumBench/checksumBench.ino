@@ -0,0 +1,58 @@
+// Compare the Internet checksum kernel with the plain C loop it replaced.
+// No Ethernet controller is needed; results go to the serial port.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+#define LEN 512    // bytes per run, about a full TCP segment
+#define RUNS 100
+
+byte Ethernet::buffer[LEN];
+
+// the loop fill_checksum() used to have
+static uint32_t reference (const uint8_t* ptr, uint16_t len) {
+  uint32_t sum = 0;
+  while (len > 1) {
+    sum += (uint16_t) (((uint32_t)*ptr<<8)|*(ptr+1));
+    ptr += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += ((uint32_t)*ptr)<<8;
+  return sum;
+}
+
+static void report (const __FlashStringHelper* name, uint32_t us) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(us / RUNS);
+  Serial.print(F(" us, "));
+  Serial.print((float) us * (F_CPU / 1000000L) / RUNS / LEN);
+  Serial.println(F(" cycles/byte"));
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[checksumBench]"));
+
+  randomSeed(analogRead(0));
+  for (uint16_t i = 0; i < LEN; ++i)
+    Ethernet::buffer[i] = random(256);
+
+  uint32_t a = 0, b = 0;
+  uint32_t t0 = micros();
+  for (byte i = 0; i < RUNS; ++i)
+    a = reference(Ethernet::buffer, LEN - (i & 1));
+  uint32_t t1 = micros();
+  for (byte i = 0; i < RUNS; ++i)
+    b = Checksum::add(Ethernet::buffer, LEN - (i & 1));
+  uint32_t t2 = micros();
+
+  report(F("reference"), t1 - t0);
+  report(F("Checksum::add"), t2 - t1);
+  Serial.println(Checksum::fold(a) == Checksum::fold(b) ? F("results match") : F("RESULTS DIFFER"));
+}
+
+void loop () {
+}
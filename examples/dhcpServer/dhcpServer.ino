@@ -0,0 +1,38 @@
+// Hand out addresses on a segment without a DHCP server, e.g. a single
+// laptop or a few devices connected to this node with a switch.
+// The node has a fixed address and leases the next four to its clients.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+// ethernet interface ip address and netmask
+static byte myip[] = { 192,168,7,1 };
+static byte mask[] = { 255,255,255,0 };
+// first address leased to a client
+static byte pool[] = { 192,168,7,100 };
+
+byte Ethernet::buffer[400];   // a DHCP reply needs about 330 bytes
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[dhcpServer]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+
+  // no gateway or DNS server, so the clients only get an address and the netmask
+  ether.staticSetup(myip, NULL, NULL, mask);
+  ether.printIp("IP:  ", ether.myip);
+
+  if (!ether.dhcpServerBegin(pool, 3600))
+    Serial.println(F("DHCP server failed"));
+  ether.printIp("Pool: ", pool);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+}
@@ -0,0 +1,65 @@
+// Resolve a host name in the background while the sketch keeps running.
+// dnsResolve() returns at once; packetLoop() sends and retransmits the
+// query and calls back with the address, or with an error after a timeout.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+#define REQUEST_RATE 5000 // milliseconds
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+// remote website name
+const char website[] PROGMEM = "www.google.com";
+
+byte Ethernet::buffer[500];
+static uint32_t timer;
+static bool resolved;
+
+// called from packetLoop() when the query is done
+static void dns_cb (byte status, const byte *ip) {
+  if (status == DNS_OK) {
+    ether.copyIp(ether.hisip, ip);
+    ether.printIp("Server: ", ether.hisip);
+    resolved = true;
+  } else {
+    Serial.print(F("DNS failed, status "));
+    Serial.println(status);
+  }
+}
+
+// called when the client request is complete
+static void my_result_cb (byte status, word off, word len) {
+  Serial.print(F("<<< reply "));
+  Serial.print(millis() - timer);
+  Serial.println(F(" ms"));
+  Serial.println((const char*) Ethernet::buffer + off);
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[dnsResolve]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  if (!ether.dhcpSetup())
+    Serial.println(F("DHCP failed"));
+
+  ether.printIp("IP:  ", ether.myip);
+  ether.printIp("GW:  ", ether.gwip);
+  ether.printIp("DNS: ", ether.dnsip);
+
+  ether.dnsResolve(website, dns_cb);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+
+  if (resolved && millis() - timer >= REQUEST_RATE) {
+    timer = millis();
+    Serial.println(F("\n>>> REQ"));
+    ether.browseUrl(PSTR("/"), "", website, my_result_cb);
+  }
+}
@@ -0,0 +1,57 @@
+// Demo of httpKeepAlive(): requests go out as HTTP/1.1 and, once a response
+// with a Content-Length is complete, the next request to the same server is
+// sent on the same connection without a new handshake.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+
+byte Ethernet::buffer[700];
+static uint32_t timer;
+
+const char website[] PROGMEM = "www.example.com";
+
+// called for each segment of the response
+static void my_callback (byte status, word off, word len) {
+  Serial.println(">>>");
+  if (len > 300)
+    len = 300;
+  Ethernet::buffer[off+len] = 0;
+  Serial.print((const char*) Ethernet::buffer + off);
+  Serial.println("...");
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[keepAlive]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  if (!ether.dhcpSetup())
+    Serial.println(F("DHCP failed"));
+
+  ether.printIp("IP:  ", ether.myip);
+  ether.printIp("GW:  ", ether.gwip);
+  ether.printIp("DNS: ", ether.dnsip);
+
+  if (!ether.dnsLookup(website))
+    Serial.println("DNS failed");
+
+  ether.printIp("SRV: ", ether.hisip);
+  ether.httpKeepAlive(true);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+
+  if (millis() > timer) {
+    timer = millis() + 5000;
+    Serial.println();
+    Serial.print("<<< REQ ");
+    ether.browseUrl(PSTR("/"), "", website, my_callback);
+  }
+}
@@ -0,0 +1,63 @@
+// Answer mDNS queries, so this node can be reached as sensor.local without a
+// DNS server, and announce its web page to DNS-SD browsers. Another node
+// called peer.local is looked up with the same resolver as unicast names.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+
+const char hostname[] PROGMEM = "sensor";
+const char service[] PROGMEM = "_http._tcp";
+const char txt[] PROGMEM = "path=/";
+const char peer[] PROGMEM = "peer.local";
+
+// the answers to a DNS-SD browser take about 200 bytes
+byte Ethernet::buffer[500];
+static uint32_t timer;
+
+const char page[] PROGMEM =
+"HTTP/1.0 200 OK\r\n"
+"Content-Type: text/plain\r\n"
+"\r\n"
+"Hello from sensor.local\r\n"
+;
+
+static void peer_cb (byte status, const byte *ip) {
+  if (status == DNS_OK)
+    ether.printIp("peer.local: ", ip);
+  else
+    Serial.println(F("peer.local not found"));
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[mdnsResponder]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  if (!ether.dhcpSetup(hostname))
+    Serial.println(F("DHCP failed"));
+  ether.printIp("IP:  ", ether.myip);
+
+  // without a name, the DHCP hostname is used
+  ether.mdnsAddService(service, 80, txt);
+  if (!ether.mdnsBegin(hostname))
+    Serial.println(F("No UDP listener left for mDNS"));
+}
+
+void loop () {
+  word pos = ether.packetLoop(ether.packetReceive());
+  if (pos) {
+    memcpy_P(ether.tcpOffset(), page, sizeof page);
+    ether.httpServerReply(sizeof page - 1);
+  }
+
+  if (millis() - timer >= 10000) {
+    timer = millis();
+    ether.dnsResolve(peer, peer_cb);
+  }
+}
@@ -0,0 +1,92 @@
+// Measure how fast a Stash is written, and what the bitmap scan that used
+// to allocate its blocks and count the free ones cost per block.
+// Results go to the serial port.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+
+#define LEN 2000   // bytes per stash, 32 blocks
+#define RUNS 20
+
+byte Ethernet::buffer[300];
+
+// the allocator Stash used to have, on a map of its own
+static byte oldMap[SCRATCH_MAP_SIZE];
+
+static uint8_t referenceAlloc () {
+  for (uint8_t i = 0; i < sizeof oldMap; ++i)
+    if (oldMap[i] != 0)
+      for (uint8_t j = 0; j < 8; ++j)
+        if (bitRead(oldMap[i], j)) {
+          bitClear(oldMap[i], j);
+          return (i << 3) + j;
+        }
+  return 0;
+}
+
+static uint8_t referenceCount () {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < sizeof oldMap; ++i)
+    for (uint8_t m = 0x80; m != 0; m >>= 1)
+      if (oldMap[i] & m)
+        ++count;
+  return count;
+}
+
+static void report (const __FlashStringHelper* name, uint32_t us, uint16_t per) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(us / RUNS);
+  Serial.print(F(" us, "));
+  Serial.print((float) us / RUNS / per);
+  Serial.println(F(" us each"));
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[stashBench]"));
+
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+
+  // allocate every block and count the free ones after each, like a
+  // report that checks Stash::freeCount() as it goes
+  uint8_t blocks = Stash::freeCount();
+  uint32_t t0 = micros();
+  for (byte i = 0; i < RUNS; ++i) {
+    for (uint8_t b = 1; b < SCRATCH_PAGE_NUM; ++b)
+      bitSet(oldMap[b >> 3], b & 7);
+    while (referenceAlloc() != 0)
+      referenceCount();
+  }
+  uint32_t t1 = micros();
+  report(F("old allocBlock + freeCount, per block"), t1 - t0, blocks);
+
+  // now through Stash, which also copies every block to the controller
+  uint32_t t2 = micros();
+  for (byte i = 0; i < RUNS; ++i) {
+    Stash stash;
+    stash.create();
+    for (uint16_t n = 0; n < LEN; ++n) {
+      stash.put('a' + n % 26);
+      if (n % 63 == 0)
+        Stash::freeCount();
+    }
+    stash.save();
+    stash.release();
+  }
+  uint32_t t3 = micros();
+  report(F("Stash write, per byte"), t3 - t2, LEN);
+  Serial.print((float) LEN * RUNS * 1000 / (t3 - t2));
+  Serial.println(F(" kB/s"));
+  Serial.print(Stash::freeCount());
+  Serial.println(F(" blocks free"));
+}
+
+void loop () {
+}
@@ -0,0 +1,46 @@
+// Serve a page that is larger than the packet buffer by streaming it.
+// The reply is printed piece by piece and TcpStream packs it into
+// full-sized TCP segments.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+static byte myip[] = { 192,168,1,203 };
+
+byte Ethernet::buffer[500];
+TcpStream out;
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[tcpStream]"));
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  ether.staticSetup(myip);
+}
+
+void loop () {
+  word pos = ether.packetLoop(ether.packetReceive());
+
+  if (pos) {  // check if valid tcp data is received
+    out.begin();
+    out.print(F("HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain\r\n"
+                "Pragma: no-cache\r\n"
+                "\r\n"));
+    for (byte pin = 0; pin < 6; ++pin) {
+      for (byte i = 0; i < 20; ++i) {
+        out.print(F("A"));
+        out.print(pin);
+        out.print(F(" = "));
+        out.println(analogRead(pin));
+      }
+    }
+    out.print(F("uptime "));
+    out.println(millis());
+    out.close();
+  }
+}
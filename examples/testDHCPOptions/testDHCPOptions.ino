@@ -16,6 +16,21 @@ void dhcpOptionCallback(uint8_t option, const byte* data, uint8_t len) {
   }
 }
 
+// Several callbacks can be registered, and any option of the same
+// message can be looked up from one without copying it
+void domainCallback(uint8_t option, const byte* data, uint8_t len) {
+  Serial.print(F("Domain: "));
+  Serial.write(data, len);
+  Serial.println();
+  uint8_t hostLen;
+  const byte* host = ether.dhcpOption(12, &hostLen);
+  if (host) {
+    Serial.print(F("Host name given by the server: "));
+    Serial.write(host, hostLen);
+    Serial.println();
+  }
+}
+
 void setup () {
   Serial.begin(57600);
   Serial.println(F("\n[testDHCP]"));
@@ -33,6 +48,8 @@ void setup () {
 
   // Add callback for the NTP option (DHCP Option number 42)
   ether.dhcpAddOptionCallback(42, dhcpOptionCallback);
+  // And one for the domain name (DHCP Option number 15)
+  ether.dhcpAddOptionCallback(15, domainCallback);
 
   Serial.println(F("Setting up DHCP"));
   if (!ether.dhcpSetup())
@@ -0,0 +1,59 @@
+// Collect readings in a ring buffer and flush them once per second as a
+// batch of UDP datagrams, one per reading, to two collectors.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+static byte collector1[] = { 192,168,1,10 };
+static byte collector2[] = { 192,168,1,11 };
+
+#define PORT 4000
+#define READINGS 8
+
+byte Ethernet::buffer[300];
+
+static word readings[READINGS][2];
+static byte count;
+static uint32_t sampled, flushed;
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[udpBatch]"));
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  if (!ether.dhcpSetup())
+    Serial.println(F("DHCP failed"));
+  ether.printIp("IP:  ", ether.myip);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+
+  if (millis() - sampled >= 1000 / READINGS && count < READINGS) {
+    sampled = millis();
+    readings[count][0] = sampled;
+    readings[count][1] = analogRead(0);
+    ++count;
+  }
+
+  if (millis() - flushed >= 1000) {
+    flushed = millis();
+    UdpBatchEntry batch[READINGS];
+    for (byte i = 0; i < count; ++i) {
+      batch[i].dip = i & 1 ? collector2 : collector1;
+      batch[i].dport = PORT;
+      batch[i].data = (const char*) readings[i];
+      batch[i].len = sizeof readings[i];
+    }
+    byte sent = ether.sendUdpBatch(batch, count, PORT);
+    Serial.print(sent);
+    Serial.print(F(" of "));
+    Serial.print(count);
+    Serial.println(F(" readings sent"));
+    count = 0;
+  }
+}
@@ -33,7 +33,7 @@ char textToSend[] = "test 123";
 void loop () {
     if (millis() > timer) {
       timer = millis() + 5000;
-     //static void sendUdp (char *data,uint8_t len,uint16_t sport, uint8_t *dip, uint16_t dport);
+     //static void sendUdp (const char *data,uint16_t len,uint16_t sport, const uint8_t *dip, uint16_t dport);
      ether.sendUdp(textToSend, sizeof(textToSend), srcPort, ether.hisip, dstPort );
   }
 }
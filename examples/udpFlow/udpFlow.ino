@@ -0,0 +1,71 @@
+// Send a stream of UDP samples to a collector with a UdpFlow.
+// The headers are built once, so each datagram only costs the payload.
+// Once a minute a JSON status document is built in a Stash and sent
+// from there; it may be larger than the packet buffer.
+//
+// License: GPLv2
+
+#include <EtherCard.h>
+
+// ethernet interface mac address, must be unique on the LAN
+static byte mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+static byte collector[] = { 192,168,1,10 };
+
+#define PORT 4000
+#define INTERVAL 10 // ms between samples
+
+byte Ethernet::buffer[300];
+UdpFlow flow;
+static uint32_t timer, status;
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println(F("\n[udpFlow]"));
+  // Change 'SS' to your Slave Select pin, if you arn't using the default pin
+  if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
+    Serial.println(F("Failed to access Ethernet controller"));
+  if (!ether.dhcpSetup())
+    Serial.println(F("DHCP failed"));
+  ether.printIp("IP:  ", ether.myip);
+  ether.printIp("GW:  ", ether.gwip);
+
+  // begin() looks up the MAC address once: the gateway's, or that of
+  // hisip for a collector on the LAN, so give the ARP replies time to arrive
+  ether.copyIp(ether.hisip, collector);
+  while (ether.clientWaitingGw() || millis() < 1000)
+    ether.packetLoop(ether.packetReceive());
+  flow.begin(PORT, collector, PORT);
+}
+
+void loop () {
+  ether.packetLoop(ether.packetReceive());
+
+  if (millis() - timer >= INTERVAL) {
+    timer = millis();
+    word* sample = (word*) flow.payload();
+    sample[0] = timer;
+    for (byte pin = 0; pin < 6; ++pin)
+      sample[1 + pin] = analogRead(pin);
+    flow.transmit(7 * sizeof (word));
+  }
+
+  if (millis() - status >= 60000) {
+    status = millis();
+    Stash stash;
+    stash.create();
+    stash.print(F("{\"uptime\":"));
+    stash.print(status);
+    stash.print(F(",\"pins\":["));
+    for (byte pin = 0; pin < 6; ++pin) {
+      if (pin > 0)
+        stash.print(',');
+      stash.print(analogRead(pin));
+    }
+    stash.print(F("],\"free\":"));
+    stash.print(Stash::freeCount());
+    stash.print('}');
+    stash.save();
+    flow.send(stash);
+    stash.release();
+  }
+}
@@ -27,6 +27,10 @@ uint16_t EtherCard::hisport = HTTP_PORT; // tcp port to browse to
 bool EtherCard::using_dhcp = false;
 bool EtherCard::persist_tcp_connection = false;
 uint16_t EtherCard::delaycnt = 0; //request gateway ARP lookup
+uint16_t EtherCard::tcpSynDropped = 0;
+uint16_t EtherCard::tcpBadCookies = 0;
+uint16_t EtherCard::dhcpTries = 0;
+uint32_t EtherCard::dhcpBindTime = 0;
 
 uint8_t EtherCard::begin (const uint16_t size,
                           const uint8_t* macaddr,
@@ -49,12 +53,19 @@ bool EtherCard::staticSetup (const uint8_t* my_ip,
         copyIp(myip, my_ip);
     if (gw_ip != 0)
         setGwIp(gw_ip);
-    if (dns_ip != 0)
-        copyIp(dnsip, dns_ip);
+    if (dns_ip != 0) {
+        dnsClearServers();
+        dnsAddServer(dns_ip);
+    }
     if(mask != 0)
         copyIp(netmask, mask);
     updateBroadcastAddress();
     delaycnt = 0; //request gateway ARP lookup
+    if (my_ip != 0) {
+        networkEvent(NET_ADDRESS);
+        if (gwip[0] == 0)
+            networkEvent(NET_READY);
+    }
     return true;
 }
 
@@ -38,9 +38,12 @@
 
 #include <avr/pgmspace.h>
 #include "bufferfiller.h"
+#include "checksum.h"
 #include "enc28j60.h"
 #include "net.h"
 #include "stash.h"
+#include "tcpstream.h"
+#include "udpflow.h"
 
 /** Enable DHCP.
 *   Setting this to zero disables the use of DHCP; if a program uses DHCP it will
@@ -49,6 +52,79 @@
 */
 #define ETHERCARD_DHCP 1
 
+/** EEPROM address at which the last DHCP lease is kept.
+*   The leased address is stored in 6 bytes of EEPROM from this address on.
+*   After a reset DHCP first asks the servers to confirm it (INIT-REBOOT),
+*   which takes a single exchange, and only discovers a new address if it is
+*   refused or there is no answer. Set to -1 to disable, or e.g. to
+*   (E2END - 5) for the end of the EEPROM. Make sure the
+*   sketch does not use this part of the EEPROM itself. Costs about 200 bytes
+*   flash.
+*/
+#define ETHERCARD_DHCP_EEPROM -1
+
+/** Enable link-local addresses (RFC 3927) while DHCP has no lease.
+*   Once DHCP has retransmitted its first DHCPDISCOVER without an answer, an
+*   address in 169.254/16 is probed with ARP and claimed if no other host
+*   uses it, which takes about 5 seconds more, so that the node is reachable
+*   on a link without a DHCP server. DHCP keeps trying meanwhile and its lease
+*   replaces the address. Costs 15 bytes SRAM and about 700 bytes flash.
+*/
+#define ETHERCARD_LINKLOCAL 0
+
+/** Number of callbacks for DHCP options.
+*   See dhcpAddOptionCallback(). Costs 5 bytes SRAM per callback.
+*/
+#define ETHERCARD_DHCP_CALLBACKS 2
+
+/** Ask for Rapid Commit (RFC 4039) in DHCPDISCOVER.
+*   A DHCP server that supports it answers with a DHCPACK right away, which
+*   saves the DHCPREQUEST and a round trip; other servers ignore the option.
+*   Setting this to zero saves 4 bytes per DHCPDISCOVER.
+*/
+#define ETHERCARD_DHCP_RAPID_COMMIT 1
+
+/** Number of addresses the DHCP server hands out.
+*   See dhcpServerBegin(), for a segment without a DHCP server of its own.
+*   Costs 10 bytes SRAM per lease and about 1400 bytes flash if the server
+*   is used. Set to zero to disable.
+*/
+#define ETHERCARD_DHCP_SERVER_LEASES 4
+
+/** Enable the DNS resolver in packetLoop().
+*   Setting this to zero means that answers to dnsResolve() and dnsLookup()
+*   are never seen; the queries are still sent and time out. Saves about
+*   700 bytes flash.
+*/
+#define ETHERCARD_DNS 1
+
+/** Number of DNS queries that can be pending at the same time.
+*   Costs 13 bytes SRAM per query.
+*/
+#define ETHERCARD_DNS_QUERIES 2
+
+/** Number of DNS servers the resolver can fail over between.
+*   DHCP fills the list from the servers the DHCP server offers; also see
+*   dnsAddServer(). Costs 6 bytes SRAM per server.
+*/
+#define ETHERCARD_DNS_SERVERS 3
+
+/** Number of DNS-SD services the mDNS responder can announce.
+*   See mdnsAddService(). Costs 6 bytes SRAM per service if the responder is
+*   used, at most 3.
+*/
+#define ETHERCARD_MDNS_SERVICES 2
+
+/** Number of DNS answers kept in a cache.
+*   A name found in the cache is resolved without sending a query until the
+*   TTL of its answer expires, at most after a day. Names that do not exist
+*   are cached as well, for the time the server allows. Setting this to zero
+*   disables the cache. Names are kept as a 64-bit hash, so a wrong answer
+*   needs two names that collide in both of its halves. Costs 17 bytes SRAM
+*   per entry.
+*/
+#define ETHERCARD_DNS_CACHE 4
+
 /** Enable client connections.
 * Setting this to zero means that the program cannot issue TCP client requests
 * anymore. Compilation will still work but the request will never be
@@ -56,21 +132,74 @@
 */
 #define ETHERCARD_TCPCLIENT 1
 
+/** Number of HTTP/1.1 connections the TCP client keeps open for reuse.
+*   With httpKeepAlive(true), a connection whose response carried a
+*   Content-Length stays open once the response is complete, and the next
+*   request to the same host and port is sent on it without a new handshake.
+*   Idle connections are probed every 15 seconds and dropped when the server
+*   stops answering. Setting this to zero disables the pool. Costs 41 bytes
+*   SRAM per connection.
+*/
+#define ETHERCARD_TCPCLIENT_POOL 2
+
 /** Enable TCP server functionality.
 *   Setting this to zero means that the program will not accept TCP client
 *   requests. Saves 2 bytes SRAM and 250 bytes flash.
 */
 #define ETHERCARD_TCPSERVER 1
 
+/** Enable SYN cookies for the TCP server.
+*   The initial sequence number sent in each SYN+ACK is an XTEA hash of the
+*   connection under a random key and a salt renewed about every minute. While
+*   SYN+ACKs are being dropped by the reply rate limit, and for a minute after,
+*   request data is only passed to the application if it acknowledges such a
+*   number; anything else is answered with a RST. Connections older than one to
+*   two minutes or 64 KB of reply data are then reset. Costs 30 bytes SRAM.
+*/
+#define ETHERCARD_SYNCOOKIES 1
+
 /** Enable UDP server functionality.
 *   If zero UDP server is disabled. It is
 *   still possible to register callbacks but these will never be called. Saves
-*   about 40 bytes SRAM and 200 bytes flash. If building with -flto this does not
+*   about 140 bytes SRAM and 400 bytes flash. If building with -flto this does not
 *   seem to save anything; maybe the linker is then smart enough to optimize the
 *   call away.
 */
 #define ETHERCARD_UDPSERVER 1
 
+/** Number of UDP server listeners.
+*   Each listener takes a single port or a range of ports, and is found with a
+*   binary search. Costs 15 bytes SRAM per listener.
+*/
+#define ETHERCARD_UDPSERVER_LISTENERS 8
+
+/** Number of UDP listeners that can queue datagrams in enc memory.
+*   A queued listener (see udpServerQueueOnPort()) keeps datagrams in slots
+*   reserved with enc_malloc() until the sketch reads them with
+*   udpServerRecvFrom(), so SCRATCH_LIMIT in enc28j60.h has to be lowered to
+*   make room for the slots. Costs 10 bytes SRAM per queue.
+*/
+#define ETHERCARD_UDPSERVER_QUEUES 0
+
+/** Enable reassembly of fragmented IP datagrams.
+*   Fragments are collected in enc memory, so SCRATCH_LIMIT in enc28j60.h has
+*   to be lowered by ETHERCARD_IPFRAG_SIZE + 54 bytes per slot (see
+*   IPFRAG_SLOTS in ipfrag.cpp) to make room for enc_malloc(), e.g. to 0x1400
+*   for one slot of the default size. A reassembled datagram is handed to the
+*   protocol handlers like a received packet; whatever does not fit in the
+*   buffer can be read with readPacketSlice(). If zero fragments are dropped.
+*   Costs about 60 bytes SRAM per slot.
+*/
+#define ETHERCARD_IPFRAG 0
+
+/** Largest payload of a reassembled IP datagram, in bytes.
+*   The default takes two full Ethernet fragments, e.g. a large DNS or SNMP
+*   reply. Larger datagrams are dropped. The slot is in enc memory and only
+*   its map of received fragments is in SRAM, one bit per 8 bytes. At most
+*   3528 if SCRATCH_LIMIT is lowered to 0x1200, leaving no room for Stash.
+*/
+#define ETHERCARD_IPFRAG_SIZE 2960
+
 /** Enable automatic reply to pings.
 *   Setting to zero means that the program will not automatically answer to
 *   PINGs anymore. Also the callback that can be registered to answer incoming
@@ -91,9 +220,42 @@ typedef void (*UdpServerCallback)(
     uint16_t dest_port,    ///< Port the packet was sent to
     uint8_t src_ip[IP_LEN],    ///< IP address of the sender
     uint16_t src_port,    ///< Port the packet was sent from
-    const char *data,   ///< UDP payload data
+    const char *data,   ///< UDP payload data, as much as fits into the buffer; see EtherCard::udpReadSlice()
     uint16_t len);        ///< Length of the payload data
 
+/** This structure holds the counters of a UDP server listener */
+typedef struct {
+    uint16_t packets;   ///< Packets passed to the callback
+    uint16_t drops;     ///< Packets dropped while the listener was paused or its queue was full
+    uint32_t bytes;     ///< Payload bytes passed to the callback
+} UdpListenerStats;
+
+/** This structure describes one datagram for EtherCard::sendUdpBatch() */
+typedef struct {
+    const uint8_t *dip; ///< Destination IP address
+    uint16_t dport;     ///< Destination port
+    const char *data;   ///< Payload data
+    uint16_t len;       ///< Length of the payload data, up to what fits into the buffer
+    int8_t status;      ///< Set by sendUdpBatch(): 1 sent, 0 transmit error, -1 too large
+} UdpBatchEntry;
+
+#define DNS_OK 0        ///< DnsCallback status: the name was resolved
+#define DNS_ERROR 1     ///< DnsCallback status: the server reported an error or had no address
+#define DNS_TIMEOUT 2   ///< DnsCallback status: no answer, or no link or route to the server
+
+/** This type definition defines the structure of a DNS resolver callback function */
+typedef void (*DnsCallback)(
+    uint8_t status,     ///< DNS_OK, DNS_ERROR or DNS_TIMEOUT
+    const uint8_t *ip); ///< Address of the host if status is DNS_OK, else 0
+
+#define NET_ADDRESS 0   ///< NetworkCallback event: an address was configured by DHCP, staticSetup() or as link-local address
+#define NET_READY 1     ///< NetworkCallback event: the gateway answered ARP, packets can be sent beyond the LAN
+#define NET_LOST 2      ///< NetworkCallback event: the DHCP lease ran out or was refused, or another host took the link-local address
+
+/** This type definition defines the structure of a network event callback function */
+typedef void (*NetworkCallback)(
+    uint8_t event);     ///< NET_ADDRESS, NET_READY or NET_LOST
+
 /** This type definition defines the structure of a DHCP Option callback function */
 typedef void (*DhcpOptionCallback)(
     uint8_t option,     ///< The option number
@@ -113,12 +275,16 @@ public:
     static uint8_t broadcastip[IP_LEN]; ///< Subnet broadcast address
     static uint8_t gwip[IP_LEN];   ///< Gateway
     static uint8_t dhcpip[IP_LEN]; ///< DHCP server IP address
-    static uint8_t dnsip[IP_LEN];  ///< DNS server IP address
+    static uint8_t dnsip[IP_LEN];  ///< DNS server IP address, the one in use if there are more
     static uint8_t hisip[IP_LEN];  ///< DNS lookup result
     static uint16_t hisport;  ///< TCP port to connect to (default 80)
     static bool using_dhcp;   ///< True if using DHCP
     static bool persist_tcp_connection; ///< False to break connections on first packet received
     static uint16_t delaycnt; ///< Counts number of cycles of packetLoop when no packet received - used to trigger periodic gateway ARP request
+    static uint16_t tcpSynDropped; ///< Number of SYNs not answered because SYN+ACK and RST replies were rate limited
+    static uint16_t tcpBadCookies; ///< Number of TCP server segments dropped during a SYN flood because they did not acknowledge a SYN cookie
+    static uint16_t dhcpTries; ///< Number of DHCP messages sent to obtain or extend the current lease
+    static uint32_t dhcpBindTime; ///< Milliseconds it took to obtain or extend the current lease
 
     // EtherCard.cpp
     /**   @brief  Initialise the network interface
@@ -145,10 +311,18 @@ public:
     // tcpip.cpp
     /**   @brief  Sends a UDP packet to the IP address of last processed received packet
     *     @param  data Pointer to data payload
-    *     @param  len Size of data payload (max 220)
+    *     @param  len Size of data payload (max 1472)
     *     @param  port Source IP port
+    *     @note   The payload may be larger than the data buffer, see sendUdp()
     */
-    static void makeUdpReply (const char *data, uint8_t len, uint16_t port);
+    static void makeUdpReply (const char *data, uint16_t len, uint16_t port);
+
+    /**   @brief  Sends a UDP packet from program space to the IP address of last processed received packet
+    *     @param  data Program space pointer to data payload
+    *     @param  len Size of data payload (max 1472)
+    *     @param  port Source IP port
+    */
+    static void makeUdpReply_P (const char *data PROGMEM, uint16_t len, uint16_t port);
 
     /**   @brief  Parse received data
     *     @param  plen Size of data to parse (e.g. return value of packetReceive()).
@@ -176,6 +350,12 @@ public:
     */
     static void httpServerReply_with_flags (uint16_t dlen , uint8_t flags);
 
+    /**   @brief  Get the largest TCP payload that can be sent in one segment on the current connection
+    *     @return <i>uint16_t</i> Smaller of the MSS announced by the peer and what fits into the buffer
+    *     @note   Longer replies passed to httpServerReply and friends are split into segments of this size
+    */
+    static uint16_t tcpMss ();
+
     /**   @brief  Acknowledge TCP message
     *     @todo   Is this / should this be private?
     */
@@ -272,19 +452,79 @@ public:
 
     /**   @brief  Sends a UDP packet
     *     @param  data Pointer to data
-    *     @param  len Size of payload (maximum 220 octets / bytes)
+    *     @param  len Size of payload (maximum 1472 octets / bytes, a full Ethernet frame)
     *     @param  sport Source port
     *     @param  dip Pointer to 4 byte destination IP address
     *     @param  dport Destination port
+    *     @note   A payload that does not fit into the data buffer is written straight to the ENC28J60
     */
-    static void sendUdp (const char *data, uint8_t len, uint16_t sport,
+    static void sendUdp (const char *data, uint16_t len, uint16_t sport,
                          const uint8_t *dip, uint16_t dport);
 
+    /**   @brief  Sends a UDP packet from program space
+    *     @param  data Program space pointer to data
+    *     @param  len Size of payload (maximum 1472 octets / bytes)
+    *     @param  sport Source port
+    *     @param  dip Pointer to 4 byte destination IP address
+    *     @param  dport Destination port
+    */
+    static void sendUdp_P (const char *data PROGMEM, uint16_t len, uint16_t sport,
+                           const uint8_t *dip, uint16_t dport);
+
+    /**   @brief  Sends a list of UDP packets from one source port
+    *     @param  entries Array of datagrams, each with destination and payload
+    *     @param  count Number of entries
+    *     @param  sport Source port
+    *     @return <i>uint8_t</i> Number of datagrams sent; the status of each is set in its entry
+    *     @note   Headers are only rebuilt for a new destination address, and while a frame is
+    *             transmitted the next one is written to the other half of the transmit buffer
+    *             (see ENC28J60::packetSendNext()).
+    */
+    static uint8_t sendUdpBatch (UdpBatchEntry *entries, uint8_t count, uint16_t sport);
+
+    /**   @brief  Copy part of the payload of the received UDP packet
+    *     @param  dest Pointer to memory for the data, at least maxlen+1 bytes
+    *     @param  maxlen Maximum number of bytes to copy
+    *     @param  offset Position within the payload to start at
+    *     @return <i>uint16_t</i> Number of bytes copied
+    *     @note   Reads the packet from the ENC28J60, so a UdpServerCallback can get the part
+    *             of a datagram that did not fit into the data buffer.
+    */
+    static uint16_t udpReadSlice (char *dest, uint16_t maxlen, uint16_t offset);
+
     /**   @brief  Resister the function to handle ping events
     *     @param  cb Pointer to function
     */
     static void registerPingCallback (void (*cb)(uint8_t*));
 
+    /**   @brief  Register the function to handle network events
+    *     @param  cb Function called with NET_ADDRESS, NET_READY or NET_LOST
+    *     @note   NET_READY follows NET_ADDRESS at once if there is no gateway.
+    */
+    static void registerNetworkCallback (NetworkCallback cb);
+
+    /**   @brief  Report a network event to the registered callback
+    *     @param  event NET_ADDRESS, NET_READY or NET_LOST
+    */
+    static void networkEvent (uint8_t event);                //called by dhcp and tcpip
+
+    /**   @brief  Get a pseudo random number for protocol timers and choices
+    *     @param  range Number of possible values
+    *     @return <i>uint16_t</i> Number from 0 to range - 1
+    */
+    static uint16_t randomBelow (uint16_t range);             //called by dhcp and linklocal
+
+    /**   @brief  Mix a value into the state of randomBelow()
+    *     @param  seed Value that differs between interfaces or boots
+    */
+    static void randomMix (uint32_t seed);                   //called by dhcp
+
+    /**   @brief  Send an ARP request to the broadcast address
+    *     @param  ip Pointer to 4 byte IP address to look up
+    *     @param  senderip Pointer to 4 byte IP address to send from, 0.0.0.0 for an ARP probe
+    */
+    static void arpRequest (const uint8_t *ip, const uint8_t *senderip);  //called by linklocal
+
     /**   @brief  Send ping
     *     @param  destip Pointer to 4 byte destination IP address
     */
@@ -316,12 +556,43 @@ public:
     */
     static void persistTcpConnection(bool persist);
 
+    /**   @brief  Keep HTTP connections open for later requests
+    *     @param  keep True to send HTTP/1.1 requests with browseUrl() and httpPost() and reuse their
+    *             connections (see ETHERCARD_TCPCLIENT_POOL), false for HTTP/1.0
+    *     @note   Also makes connections persistent, see persistTcpConnection(). A response with a
+    *             Content-Length leaves its connection open for the next request; any other response,
+    *             e.g. a chunked one, is read up to the server closing the connection. Response headers
+    *             may span segments, but not more than fits in the buffer per segment.
+    *             Needs ETHERCARD_TCPCLIENT_POOL.
+    */
+    static void httpKeepAlive(bool keep);
+
     //udpserver.cpp
     /**   @brief  Register function to handle incoming UDP events
     *     @param  callback Function to handle event
     *     @param  port Port to listen on
+    *     @return <i>bool</i> False if the table is full or the port already has a listener
+    */
+    static bool udpServerListenOnPort(UdpServerCallback callback, uint16_t port);
+
+    /**   @brief  Register function to handle incoming UDP events on a range of ports
+    *     @param  callback Function to handle event
+    *     @param  first Lowest port to listen on
+    *     @param  last Highest port to listen on
+    *     @return <i>bool</i> False if the table is full or the range overlaps another listener
+    */
+    static bool udpServerListenOnPortRange(UdpServerCallback callback, uint16_t first, uint16_t last);
+
+    /**   @brief  Register function to handle UDP events on all ports without a listener
+    *     @param  callback Function to handle event, 0 to stop listening
     */
-    static void udpServerListenOnPort(UdpServerCallback callback, uint16_t port);
+    static void udpServerListenOnAnyPort(UdpServerCallback callback);
+
+    /**   @brief  Remove the listener of a UDP port
+    *     @param  port Port, or any port in the range, of the listener
+    *     @return <i>bool</i> True if a listener was removed
+    */
+    static bool udpServerStopListenOnPort(uint16_t port);
 
     /**   @brief  Pause listing on UDP port
     *     @brief  port Port to pause
@@ -333,6 +604,41 @@ public:
     */
     static void udpServerResumeListenOnPort(uint16_t port);
 
+    /**   @brief  Get the counters of the listener that handles a UDP port
+    *     @param  port Port number
+    *     @return <i>const UdpListenerStats*</i> Counters, 0 if nobody listens on the port
+    */
+    static const UdpListenerStats* udpServerStats(uint16_t port);
+
+    /**   @brief  Keep the datagrams of a listener in a queue in enc memory
+    *     @param  port Port, or any port in the range, of the listener; any other port for the wildcard listener
+    *     @param  depth Number of datagrams the queue holds; further ones are dropped
+    *     @param  size Largest payload kept of each datagram, the rest is cut off
+    *     @return <i>bool</i> False if there is no such listener or no room for the queue
+    *     @note   The listener's callback, if any, is still called when a datagram was queued.
+    *             Needs ETHERCARD_UDPSERVER_QUEUES.
+    */
+    static bool udpServerQueueOnPort(uint16_t port, uint8_t depth, uint16_t size);
+
+    /**   @brief  Get the number of datagrams waiting in the queue of a listener
+    *     @param  port Port, or any port in the range, of the listener
+    *     @return <i>uint8_t</i> Number of datagrams
+    */
+    static uint8_t udpServerQueued(uint16_t port);
+
+    /**   @brief  Take the oldest datagram from the queue of a listener
+    *     @param  port Port, or any port in the range, of the listener
+    *     @param  data Pointer to memory for the payload
+    *     @param  maxlen Size of the memory at data, a longer payload is cut off
+    *     @param  src_ip Pointer to 4 bytes for the IP address of the sender, or 0
+    *     @param  src_port Pointer for the port of the sender, or 0
+    *     @param  dest_port Pointer for the port the datagram was sent to, or 0
+    *     @return <i>int16_t</i> Size of the payload copied, -1 if the queue is empty
+    */
+    static int16_t udpServerRecvFrom(uint16_t port, char *data, uint16_t maxlen,
+                                     uint8_t *src_ip = 0, uint16_t *src_port = 0,
+                                     uint16_t *dest_port = 0);
+
     /**   @brief  Check if UDP server is listening on any ports
     *     @return <i>bool</i> True if listening on any ports
     */
@@ -344,31 +650,98 @@ public:
     */
     static bool udpServerHasProcessedPacket(uint16_t len);    //called by tcpip, in packetLoop
 
+    //ipfrag.cpp
+    /**   @brief  Add a received IP fragment to its datagram
+    *     @param  len Length of received fragment
+    *     @return <i>uint16_t</i> Length of the reassembled datagram now in the buffer, 0 if incomplete
+    */
+    static uint16_t ipReassemble(uint16_t len);              //called by tcpip, in packetLoop
+
+    /**   @brief  Drop incomplete datagrams whose fragments stopped arriving
+    */
+    static void ipFragExpire();                              //called by tcpip, in packetLoop
+
     // dhcp.cpp
     /**   @brief  Update DHCP state
     *     @param  len Length of received data packet
     */
     static void DhcpStateMachine(uint16_t len);
 
+    /**   @brief  Start configuring the network interface with DHCP
+    *     @param  hname The hostname to pass to the DHCP server
+    *     @param  fromRam Set true to indicate whether hname is in RAM or in program space. Default = false
+    *     @note   Returns at once, packetLoop() obtains the lease. Without an answer a
+    *             link-local address is claimed meanwhile, see ETHERCARD_LINKLOCAL. NET_ADDRESS is reported when
+    *             it is bound and the gateway ARP lookup starts right away, see registerNetworkCallback().
+    *             DNS queries made meanwhile with dnsResolve() are sent once the address is known.
+    */
+    static void dhcpStart (const char *hname = NULL, bool fromRam =false);
+
+    /**   @brief  Check whether DHCP has obtained a lease
+    *     @return <i>bool</i> True if bound to a lease
+    */
+    static bool dhcpBound ();
+
     /**   @brief  Configure network interface with DHCP
     *     @param  hname The hostname to pass to the DHCP server
     *     @param  fromRam Set true to indicate whether hname is in RAM or in program space. Default = false
     *     @return <i>bool</i> True if DHCP successful
-    *     @note   Blocks until DHCP complete or timeout after 60 seconds
+    *     @note   Blocks until DHCP complete or timeout after 60 seconds, see dhcpStart().
+    *             Other packets are handled by packetLoop() meanwhile.
     */
     static bool dhcpSetup (const char *hname = NULL, bool fromRam =false);
 
+    /**   @brief  Get the hostname that is passed to the DHCP server
+    *     @return <i>const char*</i> The name given to dhcpStart() or dhcpSetup(), else Arduino-ENC28j60- and the last byte of the MAC address in hex
+    */
+    static const char* dhcpHostname ();
+
     /**   @brief  Register a callback for a specific DHCP option number
     *     @param  option The option number to request from the DHCP server
     *     @param  callback The function to be call when the option is received
+    *     @return <i>bool</i> False if ETHERCARD_DHCP_CALLBACKS callbacks are registered already
     */
-    static void dhcpAddOptionCallback(uint8_t option, DhcpOptionCallback callback);
+    static bool dhcpAddOptionCallback(uint8_t option, DhcpOptionCallback callback);
 
     /**   @brief  Register a callback for multiple DHCP option numbers
     *     @param  optionlist pointer to null terminate list of DHCP option numbers (must be static) 
     *     @param  callback The function to be call when the option is received
+    *     @return <i>bool</i> False if ETHERCARD_DHCP_CALLBACKS callbacks are registered already
+    */
+    static bool dhcpAddOptionCallback(uint8_t* optionlist, DhcpOptionCallback callback);
+
+    /**   @brief  Find an option of the DHCP message being processed
+    *     @param  option The option number
+    *     @param  len Pointer to the length of the option data, set if found
+    *     @return <i>const uint8_t*</i> Pointer to the option data in the packet buffer, NULL if not found
+    *     @note   The options are indexed once per message, nothing is copied. Only works
+    *             in a DhcpOptionCallback, or on NET_ADDRESS from DHCP.
+    */
+    static const uint8_t* dhcpOption (uint8_t option, uint8_t *len);
+
+#if ETHERCARD_DHCP_SERVER_LEASES
+    /**   @brief  Serve DHCP to the other hosts on the segment
+    *     @param  pool The first of ETHERCARD_DHCP_SERVER_LEASES consecutive addresses to lease
+    *     @param  leaseTime Lease time in seconds
+    *     @return <i>bool</i> False if the pool is not on our subnet, contains myip, or no UDP listener is free
+    *     @note   Call after staticSetup(). The clients get our netmask, and gwip and dnsip if set.
+    *             Leases are kept in SRAM and lost on a reset, so a request for a free address
+    *             from the pool is granted. Broadcast reception is enabled. Needs ETHERCARD_UDPSERVER
+    *             and a buffer of at least 350 bytes.
+    */
+    static bool dhcpServerBegin (const uint8_t *pool, uint32_t leaseTime = 3600);
+#endif
+
+    // linklocal.cpp
+    /**   @brief  Check whether the address is a link-local one, claimed while DHCP has no lease
+    *     @return <i>bool</i> True if myip is in 169.254/16
     */
-    static void dhcpAddOptionCallback(uint8_t* optionlist, DhcpOptionCallback callback);
+    static bool isLinkLocal ();
+
+    /**   @brief  Update link-local address state
+    *     @param  len Length of received data packet
+    */
+    static void linkLocalStateMachine (uint16_t len);       //called by tcpip, in packetLoop
 
     // dns.cpp
     /**   @brief  Perform DNS lookup
@@ -376,9 +749,82 @@ public:
     *     @param  fromRam Set true to indicate whether name is in RAM or in program space. Default = false
     *     @return <i>bool</i> True on success.
     *     @note   Result is stored in <i>hisip</i> member
+    *     @note   Blocks until the lookup is done, see dnsResolve(). Other packets are
+    *             handled by packetLoop() meanwhile.
     */
     static bool dnsLookup (const char* name, bool fromRam =false);
 
+    /**   @brief  Start a DNS lookup that is answered in packetLoop()
+    *     @param  name Host name to lookup, must stay valid until the callback
+    *     @param  callback Function to call with the result
+    *     @param  fromRam Set true to indicate whether name is in RAM or in program space. Default = false
+    *     @return <i>bool</i> False if ETHERCARD_DNS_QUERIES lookups are still pending
+    *     @note   The query is sent once the link is up and the server can be reached, and
+    *             retransmitted after 1, 2, 4 and 8 seconds, each time to the next server
+    *             (see dnsAddServer()), before DNS_TIMEOUT is reported.
+    *     @note   A name found in the cache is reported before dnsResolve() returns.
+    */
+    static bool dnsResolve (const char* name, DnsCallback callback, bool fromRam =false);
+
+    /**   @brief  Add a DNS server to fail over to
+    *     @param  ip Pointer to 4 byte IP address of the server
+    *     @return <i>bool</i> False if ETHERCARD_DNS_SERVERS servers are known already
+    *     @note   A query that is not answered in time is sent to the next server, and
+    *             later queries go to the server that answers fastest. <i>dnsip</i> is the
+    *             server in use; setting it directly replaces the list with that server.
+    */
+    static bool dnsAddServer (const uint8_t *ip);
+
+    /**   @brief  Forget all DNS servers, e.g. before adding new ones
+    */
+    static void dnsClearServers ();
+
+#if ETHERCARD_DNS_CACHE
+    /**   @brief  Forget all cached DNS answers, e.g. after changing dnsip
+    */
+    static void dnsCacheClear ();
+#endif
+
+    /**   @brief  Send or retransmit the pending DNS query when due
+    *     @note   packetLoop() calls this when no packet was received. Sketches
+    *             that keep packetLoop() busy with traffic can call it after
+    *             handling each packet, which overwrites the buffer.
+    */
+    static void dnsPoll ();                                  //called by tcpip, in packetLoop
+
+    /**   @brief  Pass a UDP packet to the DNS resolver
+    *     @param  len Length of received packet
+    *     @return <i>bool</i> True if the packet was the answer to a pending query
+    */
+    static bool dnsHasProcessedPacket (uint16_t len);       //called by tcpip, in packetLoop
+
+    // mdns.cpp
+    /**   @brief  Answer mDNS queries for this host on the LAN
+    *     @param  name Host name without .local, NULL for dhcpHostname()
+    *     @param  fromRam Set true to indicate whether name is in RAM or in program space. Default = false
+    *     @return <i>bool</i> False if no UDP listener is left for port 5353
+    *     @note   Enables multicast reception and registers a UDP server listener, so
+    *             ETHERCARD_UDPSERVER is needed. The name must stay valid.
+    *     @note   Queries for name.local and for the services of mdnsAddService() are
+    *             answered, other hosts are not probed for the same name. .local names
+    *             of other hosts are resolved by dnsResolve() and dnsLookup().
+    */
+    static bool mdnsBegin (const char* name = NULL, bool fromRam = false);
+
+    /**   @brief  Announce a DNS-SD service, e.g. a web server
+    *     @param  type Service type in program space, such as "_http._tcp"
+    *     @param  port TCP or UDP port of the service
+    *     @param  txt Content of the TXT record in program space, such as "path=/". Default = NULL
+    *     @return <i>bool</i> False if ETHERCARD_MDNS_SERVICES services are known already
+    *     @note   The service instance is named after the host: name._http._tcp.local
+    */
+    static bool mdnsAddService (const char* type, uint16_t port, const char* txt = NULL);
+
+    /**   @brief  Send the address record of this host to the LAN
+    *     @note   Called by mdnsBegin(). Call it again when the address changed, e.g. on NET_ADDRESS.
+    */
+    static void mdnsAnnounce ();
+
     // webutil.cpp
     /**   @brief  Copies an IP address
     *     @param  dst Pointer to the 4 byte destination
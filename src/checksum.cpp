@@ -0,0 +1,89 @@
+// Internet checksum kernels.
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "checksum.h"
+
+// portable version, also used for what the fast paths leave over
+static uint32_t add_words (const uint8_t* data, uint16_t len, uint32_t sum) {
+    while (len > 1) {
+        sum += ((uint16_t) data[0] << 8) | data[1];
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += (uint16_t) data[0] << 8;
+    return sum;
+}
+
+#if defined(__AVR__)
+
+// Sum 8 bytes per loop with one running add-with-carry chain: the carry out
+// of the high byte of one word goes into the low byte of the next, which is
+// exactly the end-around carry of one's complement addition. The loop counter
+// uses dec, which leaves the carry flag alone.
+static uint16_t sum_blocks (const uint8_t*& p, uint8_t blocks) {
+    uint16_t acc = 0;
+    uint8_t hi, lo;
+    asm volatile (
+        "    clc                          \n\t"
+        "1:  ld   %[hi], %a[p]+           \n\t"
+        "    ld   %[lo], %a[p]+           \n\t"
+        "    adc  %A[acc], %[lo]          \n\t"
+        "    adc  %B[acc], %[hi]          \n\t"
+        "    ld   %[hi], %a[p]+           \n\t"
+        "    ld   %[lo], %a[p]+           \n\t"
+        "    adc  %A[acc], %[lo]          \n\t"
+        "    adc  %B[acc], %[hi]          \n\t"
+        "    ld   %[hi], %a[p]+           \n\t"
+        "    ld   %[lo], %a[p]+           \n\t"
+        "    adc  %A[acc], %[lo]          \n\t"
+        "    adc  %B[acc], %[hi]          \n\t"
+        "    ld   %[hi], %a[p]+           \n\t"
+        "    ld   %[lo], %a[p]+           \n\t"
+        "    adc  %A[acc], %[lo]          \n\t"
+        "    adc  %B[acc], %[hi]          \n\t"
+        "    dec  %[n]                    \n\t"
+        "    brne 1b                      \n\t"
+        "    adc  %A[acc], __zero_reg__   \n\t" // last end-around carry
+        "    adc  %B[acc], __zero_reg__   \n\t"
+        "    adc  %A[acc], __zero_reg__   \n\t"
+        : [acc] "+r" (acc), [p] "+e" (p), [n] "+r" (blocks),
+          [hi] "=&r" (hi), [lo] "=&r" (lo)
+        :
+        : "cc"
+    );
+    return acc;
+}
+#endif
+
+uint32_t Checksum::add (const uint8_t* data, uint16_t len, uint32_t sum) {
+#if defined(__AVR__)
+    while (len >= 8) {
+        uint8_t blocks = len/8 < 255 ? len/8 : 255;
+        sum += sum_blocks(data, blocks);
+        len -= blocks*8;
+    }
+#elif (defined(__arm__) || defined(__xtensa__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Add aligned 32 bit words in host order and swap the folded result:
+    // the one's complement sum is the same in either byte order (RFC 1071).
+    if (((uintptr_t) data & 1) == 0 && len >= 8) {
+        if ((uintptr_t) data & 2) {
+            sum += ((uint16_t) data[0] << 8) | data[1];
+            data += 2;
+            len -= 2;
+        }
+        const uint32_t* w = (const uint32_t*) data;
+        uint64_t acc = 0;
+        for (uint16_t n = len >> 2; n != 0; --n)
+            acc += *w++;
+        data = (const uint8_t*) w;
+        len &= 3;
+        while (acc >> 16)
+            acc = (acc & 0xffff) + (acc >> 16);
+        sum += (uint16_t) ((acc >> 8) | (acc << 8));
+    }
+#endif
+    return add_words(data, len, sum);
+}
@@ -0,0 +1,45 @@
+/** @file */
+
+#ifndef Checksum_h
+#define Checksum_h
+
+#include <stdint.h>
+
+/** This class provides the arithmetic of the Internet checksum (RFC 1071).
+*
+*   A sum is a 32 bit accumulator of 16 bit big-endian words; it is only
+*   folded to 16 bits and complemented by fold() when the checksum is written.
+*   add() has an assembler version for AVR and a word-at-a-time version for
+*   32 bit cores, chosen at compile time; other targets use portable C.
+*/
+class Checksum {
+public:
+    /** @brief  Add a block of bytes to a sum
+    *   @param  data Pointer to the data, which must start at an even offset of the checksummed range
+    *   @param  len Number of bytes. An odd last byte counts as the high byte of a word.
+    *   @param  sum Sum to add to
+    *   @return <i>uint32_t</i> New sum
+    */
+    static uint32_t add (const uint8_t* data, uint16_t len, uint32_t sum = 0);
+
+    /** @brief  Get the term that updates a sum when a word changes (RFC 1624, eqn. 3)
+    *   @param  old Old value of the word
+    *   @param  now New value of the word
+    *   @return <i>uint32_t</i> Term to add to the complemented old checksum
+    */
+    static uint32_t change (uint16_t old, uint16_t now) {
+        return (uint16_t) ~old + (uint32_t) now;
+    }
+
+    /** @brief  Fold a sum to 16 bits and complement it
+    *   @param  sum Sum of all data covered by the checksum
+    *   @return <i>uint16_t</i> Checksum, in host byte order
+    */
+    static uint16_t fold (uint32_t sum) {
+        while (sum>>16)
+            sum = (uint16_t) sum + (sum >> 16);
+        return ~ (uint16_t) sum;
+    }
+};
+
+#endif
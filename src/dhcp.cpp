@@ -1,4 +1,4 @@
-// DHCP lookup functions based on the udp client
+// DHCP lookup functions based on the udp client, and a minimal DHCP server
 // http://www.ietf.org/rfc/rfc2131.txt
 //
 // Author: Andrew Lindsay
@@ -16,6 +16,9 @@
 
 #include "EtherCard.h"
 #include "net.h"
+#if ETHERCARD_DHCP_EEPROM >= 0
+#include <avr/eeprom.h>
+#endif
 
 #define gPB ether.buffer
 
@@ -38,6 +41,8 @@ enum {
     DHCP_STATE_REQUESTING,
     DHCP_STATE_BOUND,
     DHCP_STATE_RENEWING,
+    DHCP_STATE_REBOOTING,
+    DHCP_STATE_REBINDING,
 };
 
 /*
@@ -90,7 +95,11 @@ typedef struct {
 #define DHCP_CLIENT_PORT 68
 
 // timeouts im ms
-#define DHCP_REQUEST_TIMEOUT 10000
+#define DHCP_RETRY_FIRST 4000       // doubled for every retransmission, up to 64 s
+#define DHCP_REQUEST_TRIES 4        // DHCPREQUESTs for an offer, then discover again
+#define DHCP_REBOOT_TIMEOUT 2000    // then discover a new address
+// in seconds
+#define DHCP_RETRY_MIN 60           // between DHCPREQUESTs while renewing or rebinding
 
 #define DHCP_HOSTNAME_MAX_LEN 32
 
@@ -100,14 +109,42 @@ typedef struct {
 
 static byte dhcpState = DHCP_STATE_INIT;
 static char hostname[DHCP_HOSTNAME_MAX_LEN] = "Arduino-ENC28j60-00";   // Last two characters will be filled by last 2 MAC digits ;
+static bool hostnameSet;    // hostname was passed to dhcpSetup()
+static bool rebootLease;    // ask to confirm the lease in EEPROM once
 static uint32_t currentXid;
 static uint32_t stateTimer;
-static uint32_t leaseStart;
-static uint32_t leaseTime;
+static uint32_t retryTimeout;   // ms after stateTimer to retransmit
+static byte tries;              // of the current message
+static uint32_t acquireStart;   // millis() when we began to obtain or extend the lease
+static byte requestedIp[IP_LEN];    // from the offer
+static uint32_t secondTimer;    // millis() of the last second counted in boundSecs
+static uint32_t boundSecs;      // seconds since the lease was obtained
+static uint32_t retrySecs;      // boundSecs of the next DHCPREQUEST while renewing or rebinding
+static uint32_t leaseSecs;      // lease time
+static uint32_t renewSecs;      // T1
+static uint32_t rebindSecs;     // T2
 static byte* bufPtr;
 
-static uint8_t* dhcpCustomOptionList = NULL;
-static DhcpOptionCallback dhcpCustomOptionCallback = NULL;
+// options handed to the sketch, see dhcpAddOptionCallback()
+typedef struct {
+    const uint8_t* list;    // null terminated option numbers, NULL for option alone
+    DhcpOptionCallback callback;
+    uint8_t option;
+} DhcpCallback;
+
+static DhcpCallback callbacks[ETHERCARD_DHCP_CALLBACKS];
+static uint8_t numCallbacks;
+
+#define DHCP_OPTIONS_MAX 20 // options of a received message that are indexed
+
+// Where the options of a received message are, found in one pass
+typedef struct {
+    uint8_t count;
+    uint8_t code[DHCP_OPTIONS_MAX];
+    uint16_t offset[DHCP_OPTIONS_MAX];  // of the length byte in the buffer
+} DhcpOptions;
+
+static DhcpOptions* options;    // of the message being processed, else NULL
 
 extern uint8_t allOnes[];// = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
@@ -134,17 +171,20 @@ static void addOption (byte opt, byte len, const byte* data) {
 // INIT              / DHCPDISCOVER
 // SELECTING         / DHCPREQUEST
 // BOUND (RENEWING)  / DHCPREQUEST
-
-// ----------------------------------------------------------
-// |              |SELECTING    |RENEWING     |INIT         |
-// ----------------------------------------------------------
-// |broad/unicast |broadcast    |unicast      |broadcast    |
-// |server-ip     |MUST         |MUST NOT     |MUST NOT     | option 54
-// |requested-ip  |MUST         |MUST NOT     |MUST NOT     | option 50
-// |ciaddr        |zero         |IP address   |zero         |
-// ----------------------------------------------------------
+// BOUND (REBINDING) / DHCPREQUEST
+
+// ------------------------------------------------------------------------
+// |              |SELECTING    |RENEWING     |REBINDING    |INIT         |
+// ------------------------------------------------------------------------
+// |broad/unicast |broadcast    |unicast      |broadcast    |broadcast    |
+// |server-ip     |MUST         |MUST NOT     |MUST NOT     |MUST NOT     | option 54
+// |requested-ip  |MUST         |MUST NOT     |MUST NOT     |MUST NOT     | option 50
+// |ciaddr        |zero         |IP address   |IP address   |zero         |
+// ------------------------------------------------------------------------
+// INIT-REBOOT sends a broadcast DHCPREQUEST with requested-ip only
 
 // options used (both send/receive)
+#define DHCP_OPT_PAD                    0
 #define DHCP_OPT_SUBNET_MASK            1
 #define DHCP_OPT_ROUTERS                3
 #define DHCP_OPT_DOMAIN_NAME_SERVERS    6
@@ -155,23 +195,28 @@ static void addOption (byte opt, byte len, const byte* data) {
 #define DHCP_OPT_SERVER_IDENTIFIER      54
 #define DHCP_OPT_PARAMETER_REQUEST_LIST 55
 #define DHCP_OPT_RENEWAL_TIME           58
+#define DHCP_OPT_REBINDING_TIME         59
 #define DHCP_OPT_CLIENT_IDENTIFIER      61
+#define DHCP_OPT_RAPID_COMMIT           80
 #define DHCP_OPT_END                    255
 
 #define DHCP_HTYPE_ETHER 1
 
 static void send_dhcp_message(uint8_t *requestip) {
+    bool discover = dhcpState == DHCP_STATE_INIT || dhcpState == DHCP_STATE_SELECTING;
 
     memset(gPB, 0, UDP_DATA_P + sizeof( DHCPdata ));
 
     EtherCard::udpPrepare(DHCP_CLIENT_PORT,
-                          (dhcpState == DHCP_STATE_BOUND ? EtherCard::dhcpip : allOnes),
+                          (dhcpState == DHCP_STATE_RENEWING ? EtherCard::dhcpip : allOnes),
                           DHCP_SERVER_PORT);
 
     // If we ever don't do this, the DHCP renewal gets sent to whatever random
     // destmacaddr was used by other code. Rather than cache the MAC address of
     // the DHCP server, just force a broadcast here in all cases.
     EtherCard::copyMac(gPB + ETH_DST_MAC, allOnes); //force broadcast mac
+    if (dhcpState != DHCP_STATE_RENEWING && dhcpState != DHCP_STATE_REBINDING)
+        memset(gPB + IP_SRC_P, 0, IP_LEN); // from 0.0.0.0, also with a link-local address
 
     // Build DHCP Packet from buf[UDP_DATA_P]
     DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
@@ -179,7 +224,9 @@ static void send_dhcp_message(uint8_t *requestip) {
     dhcpPtr->htype = 1;
     dhcpPtr->hlen = 6;
     dhcpPtr->xid = currentXid;
-    if (dhcpState == DHCP_STATE_BOUND) {
+    uint16_t secs = (millis() - acquireStart) / 1000;
+    dhcpPtr->secs = (secs << 8) | (secs >> 8); // network byte order
+    if (dhcpState == DHCP_STATE_RENEWING || dhcpState == DHCP_STATE_REBINDING) {
         EtherCard::copyIp(dhcpPtr->ciaddr, EtherCard::myip);
     }
     EtherCard::copyMac(dhcpPtr->chaddr, EtherCard::mymac);
@@ -192,7 +239,7 @@ static void send_dhcp_message(uint8_t *requestip) {
         addToBuf(pgm_read_byte(&cookie[i]));
     addToBuf(DHCP_OPT_MESSAGE_TYPE); // DHCP_STATE_SELECTING, DHCP_STATE_REQUESTING
     addToBuf(1);   // Length
-    addToBuf(dhcpState == DHCP_STATE_INIT ? DHCP_DISCOVER : DHCP_REQUEST);
+    addToBuf(discover ? DHCP_DISCOVER : DHCP_REQUEST);
 
     // Client Identifier Option, this is the client mac address
     addToBuf(DHCP_OPT_CLIENT_IDENTIFIER);
@@ -206,124 +253,240 @@ static void send_dhcp_message(uint8_t *requestip) {
 
     if (requestip != NULL) {
         addOption(DHCP_OPT_REQUESTED_ADDRESS, IP_LEN, requestip);
-        addOption(DHCP_OPT_SERVER_IDENTIFIER, IP_LEN, EtherCard::dhcpip);
+        if (dhcpState != DHCP_STATE_REBOOTING)
+            addOption(DHCP_OPT_SERVER_IDENTIFIER, IP_LEN, EtherCard::dhcpip);
     }
 
+#if ETHERCARD_DHCP_RAPID_COMMIT
+    if (discover)
+        addOption(DHCP_OPT_RAPID_COMMIT, 0, NULL);
+#endif
+
     // Additional info in parameter list - minimal list for what we need
-    byte len = 3;
-    if (dhcpCustomOptionList) {
-        uint8_t *p = dhcpCustomOptionList;
-        while (*p++ != 0) len++;
-    }
     addToBuf(DHCP_OPT_PARAMETER_REQUEST_LIST);
-    addToBuf(len);    // Length
+    byte* len = bufPtr;
+    addToBuf(3);    // Length
     addToBuf(DHCP_OPT_SUBNET_MASK);
     addToBuf(DHCP_OPT_ROUTERS);
     addToBuf(DHCP_OPT_DOMAIN_NAME_SERVERS);
-    if (dhcpCustomOptionList) {
-        uint8_t *p = dhcpCustomOptionList; // Custom option list
-        while (*p != 0) {
-            addToBuf(*p++);
+    for (DhcpCallback* c = callbacks; c < callbacks + numCallbacks; ++c) {
+        if (c->list == NULL) {
+            addToBuf(c->option);
+            ++*len;
+        } else {
+            for (const uint8_t* p = c->list; *p != 0; ++p, ++*len)
+                addToBuf(*p);
         }
     }
     addToBuf(DHCP_OPT_END);
 
     // packet size will be under 300 bytes
     EtherCard::udpTransmit((bufPtr - gPB) - UDP_DATA_P);
+    EtherCard::dhcpTries++;
 }
 
-static void process_dhcp_offer(uint16_t len, uint8_t *offeredip) {
-    // Map struct onto payload
-    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+// Send a DHCPDISCOVER or DHCPREQUEST and wait 4, 8, 16, 32 and then 64 s,
+// each +-1 s at random so that interfaces booted together do not retransmit
+// together (RFC 2131 section 4.1)
+static void dhcp_send (uint8_t *requestip) {
+    send_dhcp_message(requestip);
+    retryTimeout = ((uint32_t) DHCP_RETRY_FIRST << (tries < 4 ? tries : 4)) - 1000 + EtherCard::randomBelow(2001);
+    tries++;
+    stateTimer = millis();
+}
 
-    // Offered IP address is in yiaddr
-    EtherCard::copyIp(offeredip, dhcpPtr->yiaddr);
+static uint32_t get32 (const byte* p) {
+    uint32_t v = 0;
+    for (byte i = 0; i<4; i++)
+        v = (v << 8) + p[i];
+    return v;
+}
 
-    // Search for the server IP
-    byte *ptr = (byte*) (dhcpPtr + 1) + 4;
-    do {
+// Index the options of the DHCP message in the buffer in one pass
+// and return its type, 0 if it has none
+static byte dhcp_scan_options (byte *end, DhcpOptions& opts) {
+    byte *ptr = gPB + UDP_DATA_P + sizeof( DHCPdata ) + 4; // after the magic cookie
+    opts.count = 0;
+    while (ptr < end) {
         byte option = *ptr++;
-        byte optionLen = *ptr++;
-        if (option == DHCP_OPT_SERVER_IDENTIFIER) {
-            EtherCard::copyIp(EtherCard::dhcpip, ptr);
+        if (option == DHCP_OPT_PAD)
+            continue;
+        if (option == DHCP_OPT_END || ptr >= end || ptr + 1 + *ptr > end)
             break;
+        if (opts.count < DHCP_OPTIONS_MAX) {
+            opts.code[opts.count] = option;
+            opts.offset[opts.count++] = ptr - gPB;
         }
-        ptr += optionLen;
-    } while (ptr < gPB + len);
+        ptr += 1 + *ptr;
+    }
+    options = &opts;
+
+    byte optionLen;
+    const byte *type = EtherCard::dhcpOption(DHCP_OPT_MESSAGE_TYPE, &optionLen);
+    return type != NULL && optionLen == 1 ? *type : 0;
 }
 
-static void process_dhcp_ack(uint16_t len) {
+// Index the options of a DHCP message from a server to us
+static byte dhcp_index_options (uint16_t len, DhcpOptions& opts) {
+    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+
+    if (len < UDP_DATA_P + sizeof( DHCPdata ) + 4 || gPB[IP_PROTO_P] != IP_PROTO_UDP_V ||
+            gPB[UDP_SRC_PORT_H_P] != 0 || gPB[UDP_SRC_PORT_L_P] != DHCP_SERVER_PORT ||
+            gPB[UDP_DST_PORT_H_P] != 0 || gPB[UDP_DST_PORT_L_P] != DHCP_CLIENT_PORT ||
+            dhcpPtr->op != DHCP_BOOTRESPONSE || dhcpPtr->xid != currentXid ||
+            memcmp(dhcpPtr->chaddr, EtherCard::mymac, ETH_LEN) != 0)
+        return 0;
+    return dhcp_scan_options(gPB + len, opts);
+}
+
+// Copy an address option
+static void get_ip (byte option, uint8_t *ip) {
+    byte optionLen;
+    const byte *ptr = EtherCard::dhcpOption(option, &optionLen);
+    if (ptr != NULL && optionLen >= IP_LEN)
+        EtherCard::copyIp(ip, ptr);
+}
+
+static uint32_t get32 (byte option, uint32_t value) {
+    byte optionLen;
+    const byte *ptr = EtherCard::dhcpOption(option, &optionLen);
+    if (ptr != NULL && optionLen == 4) {
+        value = 0;
+        for (byte i = 0; i<4; i++)
+            value = (value << 8) + ptr[i];
+    }
+    return value;
+}
+
+static void process_dhcp_offer(uint8_t *offeredip) {
+    // Map struct onto payload
+    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+
+    // Offered IP address is in yiaddr
+    EtherCard::copyIp(offeredip, dhcpPtr->yiaddr);
+    get_ip(DHCP_OPT_SERVER_IDENTIFIER, EtherCard::dhcpip);
+}
+
+static void process_dhcp_ack() {
     // Map struct onto payload
     DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
 
     // Allocated IP address is in yiaddr
     EtherCard::copyIp(EtherCard::myip, dhcpPtr->yiaddr);
+    get_ip(DHCP_OPT_SUBNET_MASK, EtherCard::netmask);
+    get_ip(DHCP_OPT_ROUTERS, EtherCard::gwip);
+    get_ip(DHCP_OPT_SERVER_IDENTIFIER, EtherCard::dhcpip); // there was no offer after INIT-REBOOT or rapid commit
+
+    byte optionLen;
+    const byte *ptr = EtherCard::dhcpOption(DHCP_OPT_DOMAIN_NAME_SERVERS, &optionLen);
+    if (ptr != NULL) {
+        EtherCard::dnsClearServers();
+        for (byte i = 0; i + IP_LEN <= optionLen; i += IP_LEN)
+            EtherCard::dnsAddServer(ptr + i);
+    }
 
-    // Scan through variable length option list identifying options we want
-    byte *ptr = (byte*) (dhcpPtr + 1) + 4;
-    bool done = false;
-    do {
-        byte option = *ptr++;
-        byte optionLen = *ptr++;
-        switch (option) {
-        case DHCP_OPT_SUBNET_MASK:
-            EtherCard::copyIp(EtherCard::netmask, ptr);
-            break;
-        case DHCP_OPT_ROUTERS:
-            EtherCard::copyIp(EtherCard::gwip, ptr);
-            break;
-        case DHCP_OPT_DOMAIN_NAME_SERVERS:
-            EtherCard::copyIp(EtherCard::dnsip, ptr);
-            break;
-        case DHCP_OPT_LEASE_TIME:
-        case DHCP_OPT_RENEWAL_TIME:
-            leaseTime = 0;
-            for (byte i = 0; i<4; i++)
-                leaseTime = (leaseTime << 8) + ptr[i];
-            if (leaseTime != DHCP_INFINITE_LEASE) {
-                leaseTime *= 1000;      // milliseconds
-            }
-            break;
-        case DHCP_OPT_END:
-            done = true;
-            break;
-        default: {
-            // Is is a custom configured option?
-            if (dhcpCustomOptionList) {
-                uint8_t *p = dhcpCustomOptionList;
-                while (*p != 0) {
-                    if (option == *p) {
-                        dhcpCustomOptionCallback(option, ptr, optionLen);
-                        break;
-                    }
-                    p++;
-                }
-            }
+    leaseSecs = get32(DHCP_OPT_LEASE_TIME, DHCP_INFINITE_LEASE);
+    renewSecs = get32(DHCP_OPT_RENEWAL_TIME, 0);
+    rebindSecs = get32(DHCP_OPT_REBINDING_TIME, 0);
+    // default T1 and T2 (RFC 2131 section 4.4.5)
+    if (renewSecs == 0 || renewSecs > leaseSecs)
+        renewSecs = leaseSecs / 2;
+    if (rebindSecs < renewSecs || rebindSecs > leaseSecs)
+        rebindSecs = leaseSecs - leaseSecs / 8;
+
+    for (DhcpCallback* c = callbacks; c < callbacks + numCallbacks; ++c) {
+        for (const uint8_t* p = c->list != NULL ? c->list : &c->option; *p != 0; ++p) {
+            ptr = EtherCard::dhcpOption(*p, &optionLen);
+            if (ptr != NULL)
+                c->callback(*p, ptr, optionLen);
+            if (c->list == NULL)
+                break;
         }
     }
-    ptr += optionLen;
 }
-while (!done && ptr < gPB + len);
+
+// Transaction ID, unique to this interface even when many boot at the same time
+static uint32_t newXid () {
+    uint32_t xid = millis();
+    for (byte i = 2; i < ETH_LEN; i++)
+        xid ^= (uint32_t) EtherCard::mymac[i] << (8 * (i - 2));
+    return xid;
 }
 
-static bool dhcp_received_message_type (uint16_t len, byte msgType) {
-    // Map struct onto payload
-    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+#if ETHERCARD_DHCP_EEPROM >= 0
+// Address of the last lease, kept in EEPROM for INIT-REBOOT
+typedef struct {
+    byte ip[IP_LEN];
+    uint16_t check;     // Checksum of ip and our MAC address, so another card does not use it
+} DhcpLease;
 
-    if (len >= 70 && gPB[UDP_SRC_PORT_L_P] == DHCP_SERVER_PORT &&
-            dhcpPtr->xid == currentXid ) {
+#define leaseRecord ((DhcpLease*) ETHERCARD_DHCP_EEPROM)
 
-        byte *ptr = (byte*) (dhcpPtr + 1) + 4;
-        do {
-            byte option = *ptr++;
-            byte optionLen = *ptr++;
-            if(option == DHCP_OPT_MESSAGE_TYPE && *ptr == msgType ) {
-                return true;
-            }
-            ptr += optionLen;
-        } while (ptr < gPB + len);
+static uint16_t leaseCheck (const DhcpLease& lease) {
+    return Checksum::fold(Checksum::add(lease.ip, IP_LEN, Checksum::add(EtherCard::mymac, ETH_LEN)));
+}
+
+static bool loadLease (DhcpLease& lease) {
+    eeprom_read_block(&lease, leaseRecord, sizeof lease);
+    return lease.ip[0] != 0 && lease.ip[0] != 0xFF && lease.check == leaseCheck(lease);
+}
+
+static void saveLease () {
+    DhcpLease lease;
+    EtherCard::copyIp(lease.ip, EtherCard::myip);
+    lease.check = leaseCheck(lease);
+    eeprom_update_block(&lease, leaseRecord, sizeof lease); // renewals write nothing
+}
+
+static void forgetLease () {
+    eeprom_update_byte(&leaseRecord->ip[0], 0);
+}
+#endif
+
+// Seconds since the lease was obtained, counted in whole seconds so that
+// long leases are timed correctly across the wrap of millis()
+static uint32_t leaseClock () {
+    while ((uint32_t) (millis() - secondTimer) >= 1000) {
+        secondTimer += 1000;
+        ++boundSecs;
+    }
+    return boundSecs;
+}
+
+// Ask to extend the lease, and retry halfway to T2 or the end of the lease
+static void dhcp_extend (uint32_t now) {
+    send_dhcp_message(NULL);
+    uint32_t wait = ((dhcpState == DHCP_STATE_RENEWING ? rebindSecs : leaseSecs) - now) / 2;
+    retrySecs = now + (wait > DHCP_RETRY_MIN ? wait : DHCP_RETRY_MIN);
+}
+
+static void dhcp_acquire () {
+    acquireStart = millis();
+    EtherCard::dhcpTries = 0;
+}
+
+static void dhcp_bound () {
+    bool renewed = dhcpState == DHCP_STATE_RENEWING || dhcpState == DHCP_STATE_REBINDING;
+    uint8_t oldgw[IP_LEN];
+    EtherCard::copyIp(oldgw, EtherCard::gwip);
+    EtherCard::disableBroadcast(true); //Disable broadcast after temporary enable
+    process_dhcp_ack();
+    EtherCard::dhcpBindTime = millis() - acquireStart;
+    secondTimer = millis();
+    boundSecs = 0;
+    dhcpState = DHCP_STATE_BOUND;
+    EtherCard::updateBroadcastAddress();
+#if ETHERCARD_DHCP_EEPROM >= 0
+    saveLease();
+#endif
+    // start the gateway ARP request right away, a renewal only needs it for a new gateway
+    if (EtherCard::gwip[0] != 0 && (!renewed || memcmp(oldgw, EtherCard::gwip, IP_LEN) != 0))
+        EtherCard::setGwIp(EtherCard::gwip);
+    if (!renewed) {
+        EtherCard::networkEvent(NET_ADDRESS);
+        if (EtherCard::gwip[0] == 0)
+            EtherCard::networkEvent(NET_READY);
     }
-    return false;
 }
 
 static char toAsciiHex(byte b) {
@@ -332,11 +495,7 @@ static char toAsciiHex(byte b) {
     return c;
 }
 
-bool EtherCard::dhcpSetup (const char *hname, bool fromRam) {
-    // Use during setup, as this discards all incoming requests until it returns.
-    // That shouldn't be a problem, because we don't have an IPaddress yet.
-    // Will try 60 secs to obtain DHCP-lease.
-
+void EtherCard::dhcpStart (const char *hname, bool fromRam) {
     using_dhcp = true;
 
     if(hname != NULL) {
@@ -346,41 +505,80 @@ bool EtherCard::dhcpSetup (const char *hname, bool fromRam) {
         else {
             strncpy_P(hostname, hname, DHCP_HOSTNAME_MAX_LEN);
         }
+        hostname[DHCP_HOSTNAME_MAX_LEN - 1] = 0;
+        hostnameSet = true;
     }
-    else {
+    dhcpHostname();
+
+    dhcpState = DHCP_STATE_INIT; // packetLoop sends DHCPDISCOVER as soon as the link is up
+    rebootLease = true;
+    randomMix(newXid());
+    dhcp_acquire();
+}
+
+bool EtherCard::dhcpBound () {
+    return dhcpState == DHCP_STATE_BOUND || dhcpState == DHCP_STATE_RENEWING ||
+           dhcpState == DHCP_STATE_REBINDING;
+}
+
+bool EtherCard::dhcpSetup (const char *hname, bool fromRam) {
+    // Use during setup, as this only returns when DHCP is done.
+    // Will try 60 secs to obtain DHCP-lease.
+    dhcpStart(hname, fromRam);
+    uint16_t start = millis();
+
+    while (dhcpState != DHCP_STATE_BOUND && uint16_t(millis()) - start < 60000)
+        packetLoop(packetReceive());
+    return dhcpState == DHCP_STATE_BOUND ;
+}
+
+const char* EtherCard::dhcpHostname () {
+    if (!hostnameSet) {
         // Set a unique hostname, use Arduino-?? with last octet of mac address
         hostname[strlen(hostname) - 2] = toAsciiHex(mymac[5] >> 4);   // Appends mac to last 2 digits of the hostname
         hostname[strlen(hostname) - 1] = toAsciiHex(mymac[5]);   // Even if it's smaller than the maximum <thus, strlen(hostname)>
     }
+    return hostname;
+}
 
-    dhcpState = DHCP_STATE_INIT;
-    uint16_t start = millis();
+static bool addCallback (const uint8_t* list, uint8_t option, DhcpOptionCallback callback)
+{
+    if (numCallbacks >= ETHERCARD_DHCP_CALLBACKS)
+        return false;
+    callbacks[numCallbacks].list = list;
+    callbacks[numCallbacks].option = option;
+    callbacks[numCallbacks].callback = callback;
+    numCallbacks++;
+    return true;
+}
 
-    while (dhcpState != DHCP_STATE_BOUND && uint16_t(millis()) - start < 60000) {
-        if (isLinkUp()) DhcpStateMachine(packetReceive());
-    }
-    updateBroadcastAddress();
-    delaycnt = 0;
-    return dhcpState == DHCP_STATE_BOUND ;
+bool EtherCard::dhcpAddOptionCallback(uint8_t option, DhcpOptionCallback callback)
+{
+    return addCallback(NULL, option, callback);
 }
 
-void EtherCard::dhcpAddOptionCallback(uint8_t option, DhcpOptionCallback callback)
+bool EtherCard::dhcpAddOptionCallback(uint8_t* optionlist, DhcpOptionCallback callback)
 {
-    static uint8_t optionList[2];
-    optionList[0] = option;
-    optionList[1] = 0;
-    dhcpCustomOptionList = optionList;
-    dhcpCustomOptionCallback = callback;
+    return addCallback(optionlist, 0, callback);
 }
 
-void EtherCard::dhcpAddOptionCallback(uint8_t* optionlist, DhcpOptionCallback callback)
+const uint8_t* EtherCard::dhcpOption (uint8_t option, uint8_t *len)
 {
-    dhcpCustomOptionList = optionlist;
-    dhcpCustomOptionCallback = callback;
+    if (options != NULL) {
+        for (uint8_t i = 0; i < options->count; ++i) {
+            if (options->code[i] == option) {
+                *len = gPB[options->offset[i]];
+                return gPB + options->offset[i] + 1;
+            }
+        }
+    }
+    return NULL;
 }
 
 void EtherCard::DhcpStateMachine (uint16_t len)
 {
+    DhcpOptions opts;
+    byte type = len > 0 ? dhcp_index_options(len, opts) : 0;
 
 #ifdef DHCPDEBUG
     if (dhcpState != DHCP_STATE_BOUND) {
@@ -400,60 +598,328 @@ void EtherCard::DhcpStateMachine (uint16_t len)
     case DHCP_STATE_RENEWING:
         Serial.println("Renew");
         break;
+    case DHCP_STATE_REBOOTING:
+        Serial.println("Reboot");
+        break;
+    case DHCP_STATE_REBINDING:
+        Serial.println("Rebind");
+        break;
     }
 #endif
 
     switch (dhcpState) {
 
     case DHCP_STATE_BOUND:
-        //!@todo Due to millis() wrap-around, DHCP renewal may not work if leaseTime is larger than 49days
-        if (leaseTime != DHCP_INFINITE_LEASE && millis() - leaseStart >= leaseTime) {
-            send_dhcp_message(myip);
+        if (leaseSecs != DHCP_INFINITE_LEASE && leaseClock() >= renewSecs) {
+            dhcp_acquire();
+            currentXid = newXid();
             dhcpState = DHCP_STATE_RENEWING;
-            stateTimer = millis();
+            dhcp_extend(leaseClock()); // unicast to the server
+        }
+        break;
+
+    case DHCP_STATE_RENEWING:
+    case DHCP_STATE_REBINDING:
+        // the address stays in use until the lease ends
+        if (type == DHCP_ACK) {
+            dhcp_bound();
+        } else if (type == DHCP_NAK || leaseClock() >= leaseSecs) {
+#if ETHERCARD_DHCP_EEPROM >= 0
+            forgetLease();
+#endif
+            networkEvent(NET_LOST);
+            dhcp_acquire();
+            dhcpState = DHCP_STATE_INIT;
+        } else if (dhcpState == DHCP_STATE_RENEWING && leaseClock() >= rebindSecs) {
+            dhcpState = DHCP_STATE_REBINDING;
+            enableBroadcast(true); // a server other than ours may answer
+            dhcp_extend(leaseClock());
+        } else if (leaseClock() >= retrySecs) {
+            dhcp_extend(leaseClock());
         }
         break;
 
     case DHCP_STATE_INIT:
-        currentXid = millis();
-        memset(myip,0,IP_LEN); // force ip 0.0.0.0
-        send_dhcp_message(NULL);
+        if (!isLinkUp())
+            break;
+        currentXid = newXid();
+        if (!isLinkLocal())
+            memset(myip,0,IP_LEN); // force ip 0.0.0.0, a link-local address stays until we have a lease
         enableBroadcast(true); //Temporarily enable broadcasts
+        tries = 0;
+#if ETHERCARD_DHCP_EEPROM >= 0
+        if (rebootLease) {
+            DhcpLease lease;
+            rebootLease = false; // only once, then discover
+            if (loadLease(lease)) {
+                dhcpState = DHCP_STATE_REBOOTING;
+                dhcp_send(lease.ip);
+                retryTimeout = DHCP_REBOOT_TIMEOUT;
+                break;
+            }
+        }
+#endif
         dhcpState = DHCP_STATE_SELECTING;
-        stateTimer = millis();
+        dhcp_send(NULL);
         break;
 
     case DHCP_STATE_SELECTING:
-        if (dhcp_received_message_type(len, DHCP_OFFER)) {
-            uint8_t offeredip[IP_LEN];
-            process_dhcp_offer(len, offeredip);
-            send_dhcp_message(offeredip);
+        if (type == DHCP_OFFER) {
+            process_dhcp_offer(requestedIp);
             dhcpState = DHCP_STATE_REQUESTING;
-            stateTimer = millis();
-        } else {
-            if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
-                dhcpState = DHCP_STATE_INIT;
-            }
+            tries = 0;
+            dhcp_send(requestedIp);
+#if ETHERCARD_DHCP_RAPID_COMMIT
+        } else if (type == DHCP_ACK) {
+            dhcp_bound();
+#endif
+        } else if (millis() - stateTimer > retryTimeout) {
+            dhcp_send(NULL); // same xid, an offer for an earlier DHCPDISCOVER is as good
         }
         break;
 
     case DHCP_STATE_REQUESTING:
-    case DHCP_STATE_RENEWING:
-        if (dhcp_received_message_type(len, DHCP_ACK)) {
-            disableBroadcast(true); //Disable broadcast after temporary enable
-            process_dhcp_ack(len);
-            leaseStart = millis();
-            if (gwip[0] != 0) setGwIp(gwip); // why is this? because it initiates an arp request
-            dhcpState = DHCP_STATE_BOUND;
-        } else {
-            if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
+    case DHCP_STATE_REBOOTING:
+        if (type == DHCP_ACK) {
+            dhcp_bound();
+        } else if (type == DHCP_NAK) {
+#if ETHERCARD_DHCP_EEPROM >= 0
+            forgetLease();
+#endif
+            dhcpState = DHCP_STATE_INIT;
+        } else if (millis() - stateTimer > retryTimeout) {
+            if (dhcpState == DHCP_STATE_REQUESTING && tries < DHCP_REQUEST_TRIES)
+                dhcp_send(requestedIp);
+            else
                 dhcpState = DHCP_STATE_INIT;
-            }
         }
         break;
 
     }
+    options = NULL;
+}
+
+#if ETHERCARD_DHCP_SERVER_LEASES
+
+// A minimal DHCP server for a segment without one: it leases the
+// ETHERCARD_DHCP_SERVER_LEASES addresses from the start of its pool and
+// keeps the leases in SRAM only.
+
+#define DHCP_OFFER_HOLD 10          // seconds an offered address is kept for the client
+#define DHCP_HEADER_LEN 44          // op to chaddr, copied into the reply
+
+typedef struct {
+    byte mac[ETH_LEN];              // client, all ones for a declined address
+    uint32_t expires;               // in serverSecs, free from then on
+} DhcpServerLease;
+
+static DhcpServerLease leases[ETHERCARD_DHCP_SERVER_LEASES];
+static byte poolStart[IP_LEN];
+static uint32_t serverLeaseSecs;
+static uint32_t serverSecs;         // seconds since dhcpServerBegin()
+static uint32_t serverTimer;        // millis() of the last second counted in serverSecs
+
+static void serverClock () {
+    uint32_t elapsed = (uint32_t) (millis() - serverTimer) / 1000;
+    serverSecs += elapsed;
+    serverTimer += elapsed * 1000;
 }
 
+static uint32_t serverExpiry (uint32_t secs) {
+    return secs > ~serverSecs ? DHCP_INFINITE_LEASE : serverSecs + secs;
+}
 
+static bool leaseFree (const DhcpServerLease* lease) {
+    return lease->expires <= serverSecs;
+}
 
+// The lease of an address, NULL if it is not in the pool
+static DhcpServerLease* poolLease (const byte *ip) {
+    if (memcmp(ip, poolStart, IP_LEN - 1) != 0 || ip[3] < poolStart[3] ||
+            ip[3] - poolStart[3] >= ETHERCARD_DHCP_SERVER_LEASES)
+        return NULL;
+    return leases + (ip[3] - poolStart[3]);
+}
+
+static void leaseIp (const DhcpServerLease* lease, byte *ip) {
+    EtherCard::copyIp(ip, poolStart);
+    ip[3] += lease - leases;
+}
+
+static bool onSubnet (const byte *ip) {
+    for (byte i = 0; i < IP_LEN; i++)
+        if ((ip[i] ^ EtherCard::myip[i]) & EtherCard::netmask[i])
+            return false;
+    return true;
+}
+
+// Answer in place of the request, whose header is still in the buffer
+static void send_dhcp_reply (byte type, const DhcpServerLease* lease, bool rapid) {
+    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+    byte header[DHCP_HEADER_LEN];
+    memcpy(header, dhcpPtr, DHCP_HEADER_LEN);
+    bool broadcast = type == DHCP_NAK || (header[10] & 0x80) != 0; // the client's broadcast flag
+
+    // RFC 2131 section 4.1: to ciaddr if the client has one, else to the
+    // offered address at the client's MAC, unless it asks for a broadcast
+    byte dip[IP_LEN];
+    if (broadcast)
+        EtherCard::copyIp(dip, allOnes);
+    else if (dhcpPtr->ciaddr[0] != 0)
+        EtherCard::copyIp(dip, dhcpPtr->ciaddr);
+    else
+        leaseIp(lease, dip);
+    EtherCard::udpPrepare(DHCP_SERVER_PORT, dip, DHCP_CLIENT_PORT);
+    if (!broadcast)
+        EtherCard::copyMac(gPB + ETH_DST_MAC, header + 28); // chaddr, it may not answer ARP yet
+
+    memset(dhcpPtr, 0, sizeof( DHCPdata ));
+    memcpy(dhcpPtr, header, DHCP_HEADER_LEN);
+    dhcpPtr->op = DHCP_BOOTRESPONSE;
+    dhcpPtr->hops = 0;
+    dhcpPtr->secs = 0;
+    if (type != DHCP_NAK)
+        leaseIp(lease, dhcpPtr->yiaddr);
+    else
+        memset(dhcpPtr->ciaddr, 0, IP_LEN);
+
+    bufPtr = gPB + UDP_DATA_P + sizeof( DHCPdata );
+    static const byte cookie[] PROGMEM = { 0x63,0x82,0x53,0x63 };
+    for (byte i = 0; i < sizeof(cookie); i++)
+        addToBuf(pgm_read_byte(&cookie[i]));
+    addOption(DHCP_OPT_MESSAGE_TYPE, 1, &type);
+    addOption(DHCP_OPT_SERVER_IDENTIFIER, IP_LEN, EtherCard::myip);
+    if (type != DHCP_NAK) {
+        byte secs[4];
+        for (byte i = 0; i < 4; i++)
+            secs[i] = serverLeaseSecs >> (24 - 8 * i);
+        addOption(DHCP_OPT_LEASE_TIME, 4, secs);
+        addOption(DHCP_OPT_SUBNET_MASK, IP_LEN, EtherCard::netmask);
+        if (EtherCard::gwip[0] != 0)
+            addOption(DHCP_OPT_ROUTERS, IP_LEN, EtherCard::gwip);
+        if (EtherCard::dnsip[0] != 0)
+            addOption(DHCP_OPT_DOMAIN_NAME_SERVERS, IP_LEN, EtherCard::dnsip);
+        if (rapid)
+            addOption(DHCP_OPT_RAPID_COMMIT, 0, NULL);
+    }
+    addToBuf(DHCP_OPT_END);
+
+    EtherCard::udpTransmit((bufPtr - gPB) - UDP_DATA_P);
+}
+
+// Choose an address for a DHCPDISCOVER: the client's own, the one it asks
+// for, or the first free one
+static DhcpServerLease* offerLease (const byte *mac) {
+    DhcpServerLease* lease;
+    for (lease = leases; lease < leases + ETHERCARD_DHCP_SERVER_LEASES; ++lease)
+        if (memcmp(lease->mac, mac, ETH_LEN) == 0)
+            return lease;
+    byte optionLen;
+    const byte *ptr = EtherCard::dhcpOption(DHCP_OPT_REQUESTED_ADDRESS, &optionLen);
+    if (ptr != NULL && optionLen == IP_LEN) {
+        lease = poolLease(ptr);
+        if (lease != NULL && leaseFree(lease))
+            return lease;
+    }
+    for (lease = leases; lease < leases + ETHERCARD_DHCP_SERVER_LEASES; ++lease)
+        if (leaseFree(lease))
+            return lease;
+    return NULL;
+}
+
+static void dhcpServerReceive (uint16_t /*port*/, uint8_t /*src_ip*/[IP_LEN], uint16_t src_port,
+                               const char *data, uint16_t len) {
+    DHCPdata *dhcpPtr = (DHCPdata*) (gPB + UDP_DATA_P);
+    if (src_port != DHCP_CLIENT_PORT || len < sizeof( DHCPdata ) + 4 ||
+            dhcpPtr->op != DHCP_BOOTREQUEST || dhcpPtr->htype != DHCP_HTYPE_ETHER ||
+            dhcpPtr->hlen != ETH_LEN || dhcpPtr->giaddr[0] != 0) // relay agents are not supported
+        return;
+
+    byte *end = (byte*) data + len;
+    if (end > gPB + EtherCard::bufferSize)
+        end = gPB + EtherCard::bufferSize;
+    DhcpOptions opts;
+    byte type = dhcp_scan_options(end, opts);
+    serverClock();
+
+    byte optionLen;
+    const byte *requested = EtherCard::dhcpOption(DHCP_OPT_REQUESTED_ADDRESS, &optionLen);
+    if (requested != NULL && optionLen != IP_LEN)
+        requested = NULL;
+    const byte *serverId = EtherCard::dhcpOption(DHCP_OPT_SERVER_IDENTIFIER, &optionLen);
+    if (serverId != NULL && optionLen != IP_LEN)
+        serverId = NULL;
+    const byte *mac = dhcpPtr->chaddr;
+    DhcpServerLease* lease;
+
+    switch (type) {
+    case DHCP_DISCOVER:
+        lease = offerLease(mac);
+        if (lease == NULL)
+            break; // the pool is exhausted
+        EtherCard::copyMac(lease->mac, mac);
+        if (EtherCard::dhcpOption(DHCP_OPT_RAPID_COMMIT, &optionLen) != NULL) {
+            lease->expires = serverExpiry(serverLeaseSecs);
+            send_dhcp_reply(DHCP_ACK, lease, true);
+        } else {
+            if (leaseFree(lease) || lease->expires < serverSecs + DHCP_OFFER_HOLD)
+                lease->expires = serverSecs + DHCP_OFFER_HOLD;
+            send_dhcp_reply(DHCP_OFFER, lease, false);
+        }
+        break;
+
+    case DHCP_REQUEST:
+        if (serverId != NULL && memcmp(serverId, EtherCard::myip, IP_LEN) != 0) {
+            // the client chose another server, withdraw our offer
+            for (lease = leases; lease < leases + ETHERCARD_DHCP_SERVER_LEASES; ++lease)
+                if (memcmp(lease->mac, mac, ETH_LEN) == 0)
+                    lease->expires = serverSecs;
+            break;
+        }
+        // after an offer or at INIT-REBOOT the address is in option 50,
+        // while renewing or rebinding it is in ciaddr
+        if (requested == NULL)
+            requested = dhcpPtr->ciaddr;
+        lease = poolLease(requested);
+        if (lease != NULL && (leaseFree(lease) || memcmp(lease->mac, mac, ETH_LEN) == 0)) {
+            // a free address is granted as well, leases are lost on a reset
+            EtherCard::copyMac(lease->mac, mac);
+            lease->expires = serverExpiry(serverLeaseSecs);
+            send_dhcp_reply(DHCP_ACK, lease, false);
+        } else if (lease != NULL || !onSubnet(requested)) {
+            send_dhcp_reply(DHCP_NAK, NULL, false);
+        }
+        break; // other addresses on the subnet are none of our business
+
+    case DHCP_DECLINE:
+        // another host uses the address, keep it out of the pool for a lease time
+        lease = requested != NULL ? poolLease(requested) : NULL;
+        if (lease != NULL && memcmp(lease->mac, mac, ETH_LEN) == 0) {
+            EtherCard::copyMac(lease->mac, allOnes);
+            lease->expires = serverExpiry(serverLeaseSecs);
+        }
+        break;
+
+    case DHCP_RELEASE:
+        lease = poolLease(dhcpPtr->ciaddr);
+        if (lease != NULL && memcmp(lease->mac, mac, ETH_LEN) == 0)
+            lease->expires = serverSecs; // the client is offered it again
+        break;
+    }
+    options = NULL;
+}
+
+bool EtherCard::dhcpServerBegin (const uint8_t *pool, uint32_t leaseTime) {
+    if (myip[0] == 0 || !onSubnet(pool) || pool[3] == 0 ||
+            pool[3] + ETHERCARD_DHCP_SERVER_LEASES - 1 > 254)
+        return false;
+    copyIp(poolStart, pool);
+    if (poolLease(myip) != NULL)
+        return false; // our own address cannot be leased
+    serverLeaseSecs = leaseTime;
+    serverTimer = millis();
+    enableBroadcast();
+    return udpServerListenOnPort(dhcpServerReceive, DHCP_SERVER_PORT);
+}
+
+#endif
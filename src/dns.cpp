@@ -11,15 +11,181 @@
 
 static byte dnstid_l; // a counter for transaction ID
 #define DNSCLIENT_SRC_PORT_H 0xE0
+#define MDNS_PORT 5353
 
 #define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
 #define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
 
-static void dnsRequest (const char *hostname, bool fromRam) {
-    ++dnstid_l; // increment for next request, finally wrap
+#define DNS_RETRY_MS 1000   // first retransmit timeout, doubled for each retry
+#define DNS_TRIES 4         // queries sent before giving up, after 15 s
+#define DNS_WAIT_MS 30000   // time allowed for DHCP, the link and the ARP reply before the first query
+#define DNS_ARP_MS 1000     // time allowed for the ARP reply after failing over to another server
+#define DNS_TTL_MAX 86400   // seconds an answer is cached at most
+#define DNS_HOPS_MAX 16     // compression pointers followed in a name, against loops
+
+// Two independent 32-bit hashes of a name, so that two names only share
+// a cache entry if both collide at once
+typedef struct {
+    uint32_t fnv;           // FNV-1a, 0 if a cache entry is unused
+    uint32_t djb;           // Bernstein's
+} DnsNameHash;
+
+typedef struct {
+    DnsCallback cb;         // 0 if the slot is free
+    const char* name;
+    DnsNameHash hash;       // of the name, for the cache
+    bool fromRam;
+    bool mdns;              // a .local name, asked on the LAN with a one-shot mDNS query
+    uint8_t tid;            // transaction id, also the low byte of the source port
+    uint8_t tries;          // queries sent so far
+    uint8_t server;         // the last query went to servers[server]
+    uint16_t timer;         // millis() of the last query or of dnsResolve()
+} DnsQuery;
+
+static DnsQuery queries[ETHERCARD_DNS_QUERIES];
+static const uint8_t mdnsip[IP_LEN] = { 224,0,0,251 };
+
+// When a query times out it is sent to the next server in the list, and
+// later queries stay there. After an answer the resolver moves to the server
+// with the lowest smoothed round trip time; a timeout counts as a slow
+// answer. dnsip is the server in use.
+typedef struct {
+    uint8_t ip[IP_LEN];
+    uint16_t srtt;          // smoothed round trip time in ms, 0 if unknown
+} DnsServer;
+
+static DnsServer servers[ETHERCARD_DNS_SERVERS];
+static uint8_t numServers;
+static uint8_t current;     // dnsip is servers[current]
+
+static uint16_t serverCost (const DnsServer* s) {
+    return s->srtt != 0 ? s->srtt : DNS_RETRY_MS; // unknown servers look slow
+}
+
+static void selectServer (uint8_t i) {
+    current = i;
+    EtherCard::copyIp(ether.dnsip, servers[i].ip);
+}
+
+// a sketch may set dnsip itself, that server is used alone then
+static void checkServers () {
+    if (numServers > 0 && memcmp(ether.dnsip, servers[current].ip, IP_LEN) == 0)
+        return;
+    numServers = 0;
     if (ether.dnsip[0] == 0)
         memset(ether.dnsip, 8, IP_LEN); // use 8.8.8.8 Google DNS as default
-    ether.udpPrepare((DNSCLIENT_SRC_PORT_H << 8) | dnstid_l, ether.dnsip, DNS_PORT);
+    EtherCard::dnsAddServer(ether.dnsip);
+}
+
+static void serverFailed (uint8_t i) {
+    uint32_t cost = 2 * (uint32_t) serverCost(&servers[i]) + DNS_RETRY_MS;
+    servers[i].srtt = cost < 0xFFFF ? cost : 0xFFFF;
+    selectServer((i + 1) % numServers);
+}
+
+static void serverAnswered (uint8_t i, uint16_t rtt) {
+    DnsServer* s = &servers[i];
+    if (rtt == 0)
+        rtt = 1;
+    s->srtt = s->srtt == 0 ? rtt : ((uint32_t) 3 * s->srtt + rtt) / 4;
+    uint8_t best = 0;
+    for (uint8_t j = 1; j < numServers; ++j)
+        if (serverCost(&servers[j]) < serverCost(&servers[best]))
+            best = j;
+    selectServer(best);
+}
+
+#if ETHERCARD_DNS_CACHE
+// Names are only kept as a 64-bit hash, so an entry costs 17 bytes whatever
+// the length of the name. A failed lookup is cached too, for as long as the
+// SOA record in the answer says (RFC 2308).
+typedef struct {
+    DnsNameHash hash;
+    uint32_t expires;       // millis() when the entry becomes stale
+    uint8_t status;         // DNS_OK or DNS_ERROR
+    uint8_t ip[IP_LEN];
+} DnsCacheEntry;
+
+static DnsCacheEntry cache[ETHERCARD_DNS_CACHE];
+
+static bool sameHash (const DnsNameHash& a, const DnsNameHash& b) {
+    return a.fnv == b.fnv && a.djb == b.djb;
+}
+
+static DnsCacheEntry* cacheFind (const DnsNameHash& hash) {
+    uint32_t now = millis();
+    for (DnsCacheEntry* e = cache; e < cache + ETHERCARD_DNS_CACHE; ++e)
+        if (sameHash(e->hash, hash) && (int32_t) (e->expires - now) > 0)
+            return e;
+    return 0;
+}
+
+static void cacheStore (const DnsNameHash& hash, uint8_t status, const uint8_t* ip, uint32_t ttl) {
+    uint32_t now = millis();
+    // replace the entry for this name, else the one that expires first
+    DnsCacheEntry* e = cache;
+    for (DnsCacheEntry* c = cache; c < cache + ETHERCARD_DNS_CACHE; ++c) {
+        if (sameHash(c->hash, hash)) {
+            e = c;
+            break;
+        }
+        if ((int32_t) (c->expires - now) < (int32_t) (e->expires - now))
+            e = c;
+    }
+    e->hash = hash;
+    e->expires = now + ttl * 1000;
+    e->status = status;
+    if (ip != 0)
+        EtherCard::copyIp(e->ip, ip);
+}
+#endif
+
+// FNV-1a and djb2 hashes of a host name, ignoring case
+static DnsNameHash nameHash (const char* name, bool fromRam) {
+    DnsNameHash h = { 2166136261UL, 5381 };
+    for (;;) {
+        char c = fromRam ? *name : pgm_read_byte(name);
+        if (c == 0) {
+            if (h.fnv == 0)
+                h.fnv = 1; // zero marks an unused cache entry
+            return h;
+        }
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        h.fnv = (h.fnv ^ (uint8_t) c) * 16777619UL;
+        h.djb = (h.djb << 5) + h.djb + (uint8_t) c;
+        ++name;
+    }
+}
+
+// true for names in the .local domain, which belong to mDNS (RFC 6762)
+static bool isLocal (const char* name, bool fromRam) {
+    static const char local[] PROGMEM = ".local";
+    size_t n = fromRam ? strlen(name) : strlen_P(name);
+    if (n < sizeof local - 1)
+        return false;
+    name += n - (sizeof local - 1);
+    for (uint8_t i = 0; i < sizeof local - 1; ++i) {
+        char c = fromRam ? name[i] : pgm_read_byte(name + i);
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        if (c != (char) pgm_read_byte(local + i))
+            return false;
+    }
+    return true;
+}
+
+// the transaction id and source port stay the same for retransmits, so a
+// late answer to an earlier copy of the query is accepted too
+static void dnsRequest (const DnsQuery* q) {
+    const char* hostname = q->name;
+    if (q->mdns) // answered by unicast to our port (RFC 6762 section 5.1)
+        ether.udpPrepare((DNSCLIENT_SRC_PORT_H << 8) | q->tid, mdnsip, MDNS_PORT);
+    else
+        ether.udpPrepare((DNSCLIENT_SRC_PORT_H << 8) | q->tid, ether.dnsip, DNS_PORT);
     memset(gPB + UDP_DATA_P, 0, 12);
 
     byte *p = gPB + UDP_DATA_P + 12;
@@ -27,7 +193,7 @@ static void dnsRequest (const char *hostname, bool fromRam) {
     do {
         byte n = 0;
         for(;;) {
-            c = fromRam ? *hostname : pgm_read_byte(hostname);
+            c = q->fromRam ? *hostname : pgm_read_byte(hostname);
             ++hostname;
             if (c == '.' || c == 0)
                 break;
@@ -43,51 +209,276 @@ static void dnsRequest (const char *hostname, bool fromRam) {
     *p++ = 0;
     *p++ = DNS_CLASS_IN;
     byte i = p - gPB - UDP_DATA_P;
-    gPB[UDP_DATA_P] = i;
-    gPB[UDP_DATA_P+1] = dnstid_l;
+    gPB[UDP_DATA_P+1] = q->tid;
     gPB[UDP_DATA_P+2] = 1; // flags, standard recursive query
     gPB[UDP_DATA_P+5] = 1; // 1 question
     ether.udpTransmit(i);
 }
 
-/** @brief  Check if packet is DNS response.
+// skip a name in the DNS message, returns 0 if it runs past the end
+static const byte* skipName (const byte* p, const byte* end) {
+    while (p < end) {
+        if ((*p & 0xC0) == 0xC0)
+            return p + 2;
+        if (*p == 0)
+            return p + 1;
+        p += *p + 1;
+    }
+    return 0;
+}
+
+// follow compression pointers to the next label, 0 if out of bounds
+static const byte* label (const byte* p, const byte* end, uint8_t& hops) {
+    const byte* msg = gPB + UDP_DATA_P;
+    while (p + 1 < end && (*p & 0xC0) == 0xC0) {
+        if (++hops > DNS_HOPS_MAX)
+            return 0;
+        p = msg + (((p[0] & 0x3F) << 8) | p[1]);
+    }
+    return p < end && p + *p < end ? p : 0;
+}
+
+// compare two names in the DNS message, ignoring case
+static bool sameName (const byte* a, const byte* b, const byte* end) {
+    uint8_t hops = 0;
+    for (;;) {
+        a = label(a, end, hops);
+        b = label(b, end, hops);
+        if (a == 0 || b == 0 || *a != *b)
+            return false;
+        uint8_t n = *a;
+        if (n == 0)
+            return true;
+        while (n > 0) {
+            byte x = *++a, y = *++b;
+            if (x >= 'A' && x <= 'Z')
+                x += 'a' - 'A';
+            if (y >= 'A' && y <= 'Z')
+                y += 'a' - 'A';
+            if (x != y)
+                return false;
+            --n;
+        }
+        ++a;
+        ++b;
+    }
+}
+
+static uint32_t get32 (const byte* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/** @brief  Parse the answer to a query
     @param  plen Size of packet
-    @return <i>bool</i> True if DNS response has error. False if not DNS response or DNS response OK.
-    @note   hisip contains IP address of requested host or 0.0.0.0 on failure
+    @param  ip Pointer to 4 bytes for the address
+    @param  ttl Set to the seconds the result may be cached, 0 if not at all
+    @return <i>uint8_t</i> DNS_OK or DNS_ERROR
+
+    CNAME records are followed from the name in the question: only records
+    of the name at the end of the chain count, and the TTL is the lowest one
+    of the chain.
 */
-static bool checkForDnsAnswer (uint16_t plen) {
-    byte *p = gPB + UDP_DATA_P; //start of UDP payload
-    if (plen < 70 || gPB[UDP_SRC_PORT_L_P] != DNS_PORT || //from DNS source port
-            gPB[UDP_DST_PORT_H_P] != DNSCLIENT_SRC_PORT_H || //response to same port as we sent from (MSB)
-            gPB[UDP_DST_PORT_L_P] != dnstid_l || //response to same port as we sent from (LSB)
-            p[1] != dnstid_l) //message id same as we sent
-        return false; //not our DNS response
-    if((p[3] & 0x0F) != 0)
-        return true; //DNS response received with error
-
-    p += *p; // we encoded the query len into tid
-    for (;;) {
-        if (*p & 0xC0)
-            p += 2;
-        else
-            while (++p < gPB + plen) {
-                if (*p == 0) {
-                    ++p;
-                    break;
-                }
-            }
-        if (p + 14 > gPB + plen)
+static uint8_t parseAnswer (uint16_t plen, uint8_t* ip, uint32_t* ttl) {
+    const byte *msg = gPB + UDP_DATA_P;
+    const byte *end = gPB + plen;
+    uint8_t rcode = msg[3] & 0x0F;
+    uint16_t ancount = (msg[6] << 8) | msg[7];
+    uint16_t nscount = (msg[8] << 8) | msg[9];
+    const byte *name = 0; // of the question, mDNS answers may leave it out
+    const byte *p = msg + 12;
+    uint32_t chain = DNS_TTL_MAX;
+
+    *ttl = 0;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN)
+        return DNS_ERROR; //server failure or refused, try again later
+    if (msg[5] != 0) {
+        name = p;
+        p = skipName(p, end);
+        if (p == 0)
+            return DNS_ERROR;
+        p += 4; // type and class
+    }
+    for (uint16_t i = 0; i < ancount + nscount; ++i) {
+        const byte *owner = p;
+        p = skipName(p, end);
+        if (p == 0 || p + 10 > end)
             break;
-        if (p[1] == DNS_TYPE_A && p[9] == 4) { // type "A" and IPv4
-            ether.copyIp(ether.hisip, p + 10);
+        uint16_t type = (p[0] << 8) | p[1];
+        uint32_t t = get32(p + 4);
+        const byte *rdata = p + 10;
+        p = rdata + ((p[8] << 8) | p[9]);
+        if (p > end)
             break;
+        if (t > DNS_TTL_MAX)
+            t = DNS_TTL_MAX;
+        if (i < ancount) {
+            if (rcode != 0 || (name != 0 && !sameName(owner, name, end)))
+                continue;
+            if (t < chain)
+                chain = t;
+            if (type == DNS_TYPE_CNAME) {
+                name = rdata;
+            } else if (type == DNS_TYPE_A && p - rdata == IP_LEN) {
+                EtherCard::copyIp(ip, rdata);
+                *ttl = chain;
+                return DNS_OK;
+            }
+        } else if (type == DNS_TYPE_SOA) {
+            // negative answers are cached for the lower of the TTL and
+            // the minimum field of the SOA record
+            const byte *s = skipName(rdata, end);
+            if (s != 0)
+                s = skipName(s, end);
+            if (s != 0 && s + 20 <= end) {
+                uint32_t minimum = get32(s + 16);
+                *ttl = t < minimum ? t : minimum;
+                if (*ttl > chain)
+                    *ttl = chain;
+            }
+        }
+    }
+    return DNS_ERROR; //name does not exist or has no address record
+}
+
+static void dnsFinish (DnsQuery* q, uint8_t status, const uint8_t* ip) {
+    DnsCallback cb = q->cb;
+    q->cb = 0; // the callback may start the next query
+    cb(status, ip);
+}
+
+bool EtherCard::dnsResolve (const char* name, DnsCallback callback, bool fromRam) {
+    if (callback == 0)
+        return false;
+    DnsNameHash hash = nameHash(name, fromRam);
+#if ETHERCARD_DNS_CACHE
+    DnsCacheEntry* e = cacheFind(hash);
+    if (e != 0) {
+        callback(e->status, e->status == DNS_OK ? e->ip : 0);
+        return true;
+    }
+#endif
+    for (DnsQuery* q = queries; q < queries + ETHERCARD_DNS_QUERIES; ++q) {
+        if (q->cb != 0)
+            continue;
+        q->cb = callback;
+        q->name = name;
+        q->hash = hash;
+        q->fromRam = fromRam;
+        q->mdns = isLocal(name, fromRam);
+        q->tid = ++dnstid_l; // increment for next request, finally wrap
+        q->tries = 0;
+        q->timer = millis();
+        return true;
+    }
+    return false; //all queries are pending
+}
+
+#if ETHERCARD_DNS_CACHE
+void EtherCard::dnsCacheClear () {
+    memset(cache, 0, sizeof cache);
+}
+#endif
+
+bool EtherCard::dnsAddServer (const uint8_t *ip) {
+    for (uint8_t i = 0; i < numServers; ++i)
+        if (memcmp(servers[i].ip, ip, IP_LEN) == 0)
+            return true;
+    if (numServers >= ETHERCARD_DNS_SERVERS)
+        return false;
+    copyIp(servers[numServers].ip, ip);
+    servers[numServers].srtt = 0;
+    if (numServers++ == 0)
+        selectServer(0);
+    return true;
+}
+
+void EtherCard::dnsClearServers () {
+    numServers = 0;
+}
+
+void EtherCard::dnsPoll () {
+    for (DnsQuery* q = queries; q < queries + ETHERCARD_DNS_QUERIES; ++q) {
+        if (q->cb == 0)
+            continue;
+        uint16_t elapsed = uint16_t(millis()) - q->timer;
+        uint16_t timeout = q->tries > 0 ? DNS_RETRY_MS << (q->tries - 1) : 0;
+        if (elapsed < timeout)
+            continue;
+        if (q->tries >= DNS_TRIES) {
+            dnsFinish(q, DNS_TIMEOUT, 0); //timeout waiting for dns response
+            continue;
+        }
+        bool configured = myip[0] != 0; // DHCP may still be running
+        if (!q->mdns && configured) {
+            checkServers();
+            if (q->tries > 0 && q->server == current)
+                serverFailed(current); // unless another query failed over already
+        }
+        bool ready = configured && isLinkUp() && (q->mdns || !clientWaitingDns());
+        if (!ready) {
+            if (q->tries == 0) {
+                if (elapsed >= DNS_WAIT_MS)
+                    dnsFinish(q, DNS_TIMEOUT, 0); //timeout waiting for link or gateway ARP
+                continue;
+            }
+            if (elapsed < timeout + DNS_ARP_MS)
+                continue;
+            // no ARP reply from this server either, count it as a lost query
         }
-        p += p[9] + 10;
+        ++q->tries;
+        q->server = current;
+        q->timer = millis();
+        if (ready)
+            dnsRequest(q);
     }
-    return false; //No error
 }
 
-// use during setup, as this discards all incoming requests until it returns
+bool EtherCard::dnsHasProcessedPacket (uint16_t plen) {
+    const byte *p = gPB + UDP_DATA_P; //start of UDP payload
+    uint16_t sport = (gPB[UDP_SRC_PORT_H_P] << 8) | gPB[UDP_SRC_PORT_L_P];
+    if (plen < UDP_DATA_P + 12 || (sport != DNS_PORT && sport != MDNS_PORT) || //from DNS source port
+            gPB[UDP_DST_PORT_H_P] != DNSCLIENT_SRC_PORT_H) //response to same port as we sent from (MSB)
+        return false;
+    DnsQuery* q = queries;
+    while (q->cb == 0 || q->tries == 0 ||
+            gPB[UDP_DST_PORT_L_P] != q->tid || //response to same port as we sent from (LSB)
+            p[1] != q->tid) //message id same as we sent
+        if (++q == queries + ETHERCARD_DNS_QUERIES)
+            return false; //not our DNS response
+    if (q->mdns) {
+        if (sport != MDNS_PORT)
+            return false; //any host on the LAN may answer
+    } else {
+        uint8_t i = 0;
+        while (i < numServers && memcmp(servers[i].ip, gPB + IP_SRC_P, IP_LEN) != 0)
+            ++i;
+        if (sport != DNS_PORT || i == numServers)
+            return false; //not from one of our servers
+        if (i == q->server)
+            serverAnswered(i, uint16_t(millis()) - q->timer);
+    }
+
+    uint8_t ip[IP_LEN];
+    uint32_t ttl;
+    uint8_t status = parseAnswer(plen, ip, &ttl);
+#if ETHERCARD_DNS_CACHE
+    if (ttl != 0)
+        cacheStore(q->hash, status, status == DNS_OK ? ip : 0, ttl);
+#endif
+    dnsFinish(q, status, status == DNS_OK ? ip : 0);
+    return true;
+}
+
+static uint8_t lookup_status; // result of dnsLookup(), 0xFF while waiting
+
+static void lookupDone (uint8_t status, const uint8_t* ip) {
+    if (status == DNS_OK)
+        ether.copyIp(ether.hisip, ip);
+    lookup_status = status;
+}
+
+// use during setup, as this only returns when the lookup is done; other
+// packets are still handled by packetLoop() while waiting
 bool EtherCard::dnsLookup (const char* name, bool fromRam) {
     uint16_t start = millis();
 
@@ -96,25 +487,13 @@ bool EtherCard::dnsLookup (const char* name, bool fromRam) {
         if (uint16_t(millis()) - start >= 30000)
             return false; //timeout waiting for link
     }
-    while(clientWaitingDns())
-    {
-        packetLoop(packetReceive());
-        if (uint16_t(millis()) - start >= 30000)
-            return false; //timeout waiting for gateway ARP
-    }
 
     memset(hisip, 0, IP_LEN);
-    dnsRequest(name, fromRam);
-
-    start = millis();
-    while (hisip[0] == 0) {
-        if (uint16_t(millis()) - start >= 30000)
-            return false; //timeout waiting for dns response
-        word len = packetReceive();
-        if (len > 0 && packetLoop(len) == 0) //packet not handled by tcp/ip packet loop
-            if(checkForDnsAnswer(len))
-                return false; //DNS response received with error
-    }
+    lookup_status = 0xFF;
+    if (!dnsResolve(name, lookupDone, fromRam))
+        return false; //another query is pending
+    while (lookup_status == 0xFF)
+        packetLoop(packetReceive());
 
-    return true;
+    return lookup_status == DNS_OK;
 }
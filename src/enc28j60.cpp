@@ -45,7 +45,7 @@ bool ENC28J60::promiscuous_enabled = false;
 // #define ERXWRPT         (0x0E|0x00)
 #define EDMAST          (0x10|0x00)
 #define EDMAND          (0x12|0x00)
-// #define EDMADST         (0x14|0x00)
+#define EDMADST         (0x14|0x00)
 #define EDMACS          (0x16|0x00)
 // Bank 1 registers
 #define EHT0             (0x00|0x20)
@@ -222,9 +222,9 @@ bool ENC28J60::promiscuous_enabled = false;
 #define ENC28J60_BIT_FIELD_CLR       0xA0
 #define ENC28J60_SOFT_RESET          0xFF
 
-// max frame length which the controller will accept:
-// (note: maximum ethernet frame length would be 1518)
-#define MAX_FRAMELEN      1500
+// max frame length which the controller will accept and send, including
+// header and CRC: a full 1500 byte Ethernet MTU
+#define MAX_FRAMELEN      1518
 
 #define FULL_SPEED  1   // switch to full-speed SPI for bulk transfers
 
@@ -320,6 +320,61 @@ static void writeBuf(uint16_t len, const byte* data) {
     disableChip();
 }
 
+// readBuf() and writeBuf() that add the data to an Internet checksum while
+// the SPI transfers the next byte; data must start at an even offset of the
+// checksummed range
+static uint32_t readBufSum(uint16_t len, byte* data, uint32_t sum) {
+    uint8_t nextbyte;
+    bool high = true;
+
+    enableChip();
+    if (len != 0) {
+        xferSPI(ENC28J60_READ_BUF_MEM);
+
+        SPDR = 0x00;
+        while (--len) {
+            while (!(SPSR & (1<<SPIF)))
+                ;
+            nextbyte = SPDR;
+            SPDR = 0x00;
+            *data++ = nextbyte;
+            sum += high ? (uint16_t) nextbyte << 8 : nextbyte;
+            high = !high;
+        }
+        while (!(SPSR & (1<<SPIF)))
+            ;
+        nextbyte = SPDR;
+        *data++ = nextbyte;
+        sum += high ? (uint16_t) nextbyte << 8 : nextbyte;
+    }
+    disableChip();
+    return sum;
+}
+
+static uint32_t writeBufSum(uint16_t len, const byte* data, uint32_t sum) {
+    bool high = true;
+
+    enableChip();
+    if (len != 0) {
+        xferSPI(ENC28J60_WRITE_BUF_MEM);
+
+        SPDR = *data;
+        while (--len) {
+            sum += high ? (uint16_t) *data << 8 : *data;
+            high = !high;
+            uint8_t nextbyte = *++data;
+            while (!(SPSR & (1<<SPIF)))
+                ;
+            SPDR = nextbyte;
+        }
+        sum += high ? (uint16_t) *data << 8 : *data;
+        while (!(SPSR & (1<<SPIF)))
+            ;
+    }
+    disableChip();
+    return sum;
+}
+
 static void SetBank (byte address) {
     if ((address & BANK_MASK) != Enc28j60Bank) {
         writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_BSEL1|ECON1_BSEL0);
@@ -456,7 +511,7 @@ struct transmit_status_vector {
     #define BREAKORCONTINUE break;
 #endif
 
-void ENC28J60::packetSend(uint16_t len) {
+void ENC28J60::packetSend(uint16_t len, uint16_t head) {
     byte retry = 0;
 
     #if ETHERCARD_SEND_PIPELINING
@@ -479,7 +534,7 @@ void ENC28J60::packetSend(uint16_t len) {
             writeReg(EWRPT, TXSTART_INIT);
             writeReg(ETXND, TXSTART_INIT+len);
             writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
-            writeBuf(len, buffer);
+            writeBuf(head, buffer);
         }
 
         // initiate transmission
@@ -532,11 +587,16 @@ void ENC28J60::packetSend(uint16_t len) {
 }
 
 
+static uint16_t sliceStart; // packet read by readPacketSlice if not zero
+static uint16_t sliceLength;
+
 uint16_t ENC28J60::packetReceive() {
     static uint16_t gNextPacketPtr = RXSTART_INIT;
     static bool     unreleasedPacket = false;
     uint16_t len = 0;
 
+    sliceStart = 0;
+
     if (unreleasedPacket) {
         if (gNextPacketPtr == 0)
             writeReg(ERXRDPT, RXSTOP_INIT);
@@ -746,6 +806,74 @@ void ENC28J60::memcpy_from_enc(void* dest, uint16_t source, int16_t num) {
     readBuf(num, (uint8_t*) dest);
 }
 
+uint32_t ENC28J60::memcpy_to_enc_sum(uint16_t dest, const void* source, int16_t num, uint32_t sum) {
+    writeReg(EWRPT, dest);
+    return writeBufSum(num, (const uint8_t*) source, sum);
+}
+
+// with ETHERCARD_SEND_PIPELINING the previous frame may still be going out of the transmit buffer
+static void waitPipelined () {
+#if ETHERCARD_SEND_PIPELINING
+    uint16_t count = 0;
+    while ((readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_TXRTS) && ++count < 1000U)
+        ;
+#endif
+}
+
+uint32_t ENC28J60::packetWrite(uint16_t offset, const void* data, uint16_t len, uint32_t sum) {
+    return memcpy_to_enc_sum(packetAddress(offset), data, len, sum);
+}
+
+static uint16_t txBusyStart; // start of the frame packetSendNext() is sending, 0 if none
+static uint16_t txBusyLen;
+
+int8_t ENC28J60::packetSendNext(uint16_t len) {
+    int8_t result = -1;
+    if (txBusyStart && (len > TXSLOT_MAX || txBusyLen > TXSLOT_MAX))
+        result = packetSendWait(); // the frames do not fit side by side
+    uint16_t start = TXSTART_INIT;
+    if (txBusyStart == TXSTART_INIT)
+        start += TXSLOT_SIZE;
+    else if (txBusyStart == 0)
+        waitPipelined();
+
+    writeReg(EWRPT, start);
+    writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+    writeBuf(len, buffer);
+    if (txBusyStart)
+        result = packetSendWait();
+
+    // same sequence as packetSend(), see there
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF|EIR_TXIF);
+    writeReg(ETXST, start);
+    writeReg(ETXND, start+len);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+    txBusyStart = start;
+    txBusyLen = len;
+    return result;
+}
+
+int8_t ENC28J60::packetSendWait() {
+    if (txBusyStart == 0)
+        return -1;
+    uint16_t count = 0;
+    while ((readRegByte(EIR) & (EIR_TXIF | EIR_TXERIF)) == 0 && ++count < 1000U)
+        ;
+    int8_t ok = !(readRegByte(EIR) & EIR_TXERIF) && count < 1000U;
+    if (!ok)
+        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS); // cancel if stuck
+    txBusyStart = 0;
+    writeReg(ETXST, TXSTART_INIT); // packetSend() only sets the end
+    return ok;
+}
+
+uint32_t ENC28J60::memcpy_from_enc_sum(void* dest, uint16_t source, int16_t num, uint32_t sum) {
+    writeReg(ERDPT, source);
+    return readBufSum(num, (uint8_t*) dest, sum);
+}
+
 static uint16_t endRam = ENC_HEAP_END;
 uint16_t ENC28J60::enc_malloc(uint16_t size) {
     if (endRam-size >= ENC_HEAP_START) {
@@ -759,18 +887,70 @@ uint16_t ENC28J60::enc_freemem() {
     return endRam-ENC_HEAP_START;
 }
 
+void ENC28J60::packetSliceSource(uint16_t start, uint16_t len) {
+    sliceStart = start;
+    sliceLength = len;
+}
+
+// run the DMA engine from start to end (inclusive), copying to dest or
+// computing the checksum of the range
+static void dmaRun(uint16_t start, uint16_t end, uint16_t dest, byte mode) {
+    writeReg(EDMAST, start);
+    writeReg(EDMAND, end);
+    writeReg(EDMADST, dest);
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | mode);
+    while (readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+        ;
+}
+
+void ENC28J60::packetSliceToEnc(uint16_t dest, uint16_t packetOffset, uint16_t num) {
+    if (num == 0)
+        return;
+    uint16_t start, end;
+    if (sliceStart) {
+        start = sliceStart+packetOffset;
+        end = start+num-1;
+    } else {
+        start = (readReg(ERXRDPT)+7+packetOffset)%(RXSTOP_INIT+1);
+        end = (start+num-1)%(RXSTOP_INIT+1); // the DMA wraps at the end of the receive buffer too
+    }
+    dmaRun(start, end, dest, 0);
+}
+
+void ENC28J60::memcpy_within_enc(uint16_t dest, uint16_t source, uint16_t num) {
+    if (num > 0)
+        dmaRun(source, source+num-1, dest, 0);
+}
+
+uint16_t ENC28J60::enc_checksum(uint16_t source, uint16_t num) {
+    if (num == 0)
+        return 0;
+    dmaRun(source, source+num-1, 0, ECON1_CSUMEN);
+    return ~readReg(EDMACS); // the engine leaves the complement
+}
+
+uint16_t ENC28J60::packetAddress(uint16_t offset) {
+    waitPipelined();
+    return TXSTART_INIT+1+offset; // skip the control byte
+}
+
 uint16_t ENC28J60::readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset) {
     uint16_t erxrdpt = readReg(ERXRDPT);
     int16_t packetLength;
 
-    memcpy_from_enc((char*) &packetLength, (erxrdpt+3)%(RXSTOP_INIT+1), 2);
-    packetLength -= 4; // remove crc
+    if (sliceStart)
+        packetLength = sliceLength;
+    else {
+        memcpy_from_enc((char*) &packetLength, (erxrdpt+3)%(RXSTOP_INIT+1), 2);
+        packetLength -= 4; // remove crc
+    }
 
     int16_t bytesToCopy = packetLength - packetOffset;
     if (bytesToCopy > maxlength) bytesToCopy = maxlength;
     if (bytesToCopy <= 0) bytesToCopy = 0;
 
-    int16_t startofSlice = (erxrdpt+7+packetOffset)%(RXSTOP_INIT+1);
+    uint16_t startofSlice = sliceStart ? sliceStart+packetOffset : (erxrdpt+7+packetOffset)%(RXSTOP_INIT+1);
     memcpy_from_enc(dest, startofSlice, bytesToCopy);
     dest[bytesToCopy] = 0;
 
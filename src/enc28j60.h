@@ -22,6 +22,8 @@
 
 #define TXSTART_INIT        0x0C00  // start of TX buffer, room for 1 packet
 #define TXSTOP_INIT         0x11FF  // end of TX buffer
+#define TXSLOT_SIZE         ((TXSTOP_INIT+1-TXSTART_INIT)/2) // half of the TX buffer, see packetSendNext()
+#define TXSLOT_MAX          (TXSLOT_SIZE-1-7) // largest frame in a half, without control byte and status vector
 
 #define SCRATCH_START       0x1200  // start of scratch area
 #define SCRATCH_LIMIT       0x2000  // past end of area, i.e. 3 Kb
@@ -68,7 +70,47 @@ public:
     *     @param  len Size of data to send
     *     @note   Data buffer is shared by receive and transmit functions
     */
-    static void packetSend (uint16_t len);
+    static void packetSend (uint16_t len) { packetSend(len, len); }
+
+    /**   @brief  Sends a frame that was partly written with packetWrite()
+    *     @param  len Size of the frame
+    *     @param  head Number of bytes at the start of the frame to take from the data buffer
+    *     @note   The rest of the frame must have been written with packetWrite() before.
+    */
+    static void packetSend (uint16_t len, uint16_t head);
+
+    /**   @brief  Write part of the next frame straight into the transmit buffer
+    *     @param  offset Position within the frame
+    *     @param  data Pointer to the data in RAM
+    *     @param  len Number of bytes to write
+    *     @param  sum Checksum sum to add the data to, see Checksum::add()
+    *     @return <i>uint32_t</i> New sum
+    *     @note   Lets a frame be larger than the data buffer, see packetSend(len, head).
+    */
+    static uint32_t packetWrite (uint16_t offset, const void* data, uint16_t len, uint32_t sum = 0);
+
+    /**   @brief  Sends a frame while the previous one from packetSendNext() may still be going out
+    *     @param  len Size of the frame in the data buffer
+    *     @return <i>int8_t</i> Result of the previous frame: 1 sent, 0 failed, -1 if there was none
+    *     @note   Frames of up to TXSLOT_MAX bytes alternate between the two halves of the transmit
+    *             buffer, so a frame is written over SPI while the previous one is transmitted.
+    *             Larger frames wait for the previous one. Late collisions are not retried.
+    *             Finish with packetSendWait() before any other frame is sent.
+    */
+    static int8_t packetSendNext (uint16_t len);
+
+    /**   @brief  Get the address of a position of the next frame in enc memory
+    *     @param  offset Position within the frame
+    *     @return <i>uint16_t</i> Address in the transmit buffer
+    *     @note   Waits until the transmit buffer is free, so the frame can be written there
+    *             directly, e.g. with memcpy_within_enc(). Send it with packetSend(len, head).
+    */
+    static uint16_t packetAddress (uint16_t offset);
+
+    /**   @brief  Wait for the last frame from packetSendNext()
+    *     @return <i>int8_t</i> 1 if it was sent, 0 if it failed, -1 if there was none
+    */
+    static int8_t packetSendWait ();
 
     /**   @brief  Copy received packets to data buffer
     *     @return <i>uint16_t</i> Size of received data
@@ -155,6 +197,36 @@ public:
     */
     static uint16_t readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset);
 
+    /** @brief  Make readPacketSlice() read from a block in enc memory instead of the received packet
+     *  @param  start start address of the packet within the enc memory, 0 to read the received packet again
+     *  @param  len length of the packet
+     *  @note   packetReceive() switches back to the received packet.
+     */
+    static void packetSliceSource(uint16_t start, uint16_t len);
+
+    /** @brief  Copies a slice from the current received packet to enc memory using the DMA engine
+     *  @param  dest destination address within enc memory
+     *  @param  packetOffset where within the packet to start
+     *  @param  num number of bytes to copy
+     *  @note   The data never passes through the Arduino, so the packet may be larger than the buffer.
+     *          Reads from the block set with packetSliceSource(), if any.
+     */
+    static void packetSliceToEnc(uint16_t dest, uint16_t packetOffset, uint16_t num);
+
+    /** @brief  Copies a block within enc memory using the DMA engine
+     *  @param  dest destination address within enc memory
+     *  @param  source source address within enc memory, outside the receive buffer
+     *  @param  num number of bytes to copy
+     */
+    static void memcpy_within_enc(uint16_t dest, uint16_t source, uint16_t num);
+
+    /** @brief  Sums a block of enc memory with the checksum engine of the DMA
+     *  @param  source start address within enc memory, outside the receive buffer
+     *  @param  num number of bytes to sum
+     *  @return <i>uint16_t</i> the folded sum, to be added to a Checksum sum
+     */
+    static uint16_t enc_checksum(uint16_t source, uint16_t num);
+
     /** @brief  reserves a block of RAM in the memory of the enc chip
      *  @param  size number of bytes to reserve
      *  @return <i>uint16_t</i> start address of the block within the enc memory. 0 if the remaining memory for malloc operation is less than size.
@@ -182,6 +254,26 @@ public:
         @param num number of bytes to copy
      */
     static void memcpy_from_enc(void* dest, uint16_t source, int16_t num);
+
+    /** @brief copies a block of data from SRAM to the enc memory and adds it to an Internet checksum on the way
+        @param dest destination address within enc memory
+        @param source source pointer to a block of SRAM in the arduino
+        @param num number of bytes to copy
+        @param sum sum to add to (see Checksum)
+        @return <i>uint32_t</i> new sum
+        @note  The block must start at an even offset of the checksummed range
+     */
+    static uint32_t memcpy_to_enc_sum(uint16_t dest, const void* source, int16_t num, uint32_t sum);
+
+    /** @brief copies a block of data from the enc memory to SRAM and adds it to an Internet checksum on the way
+        @param dest destination address within SRAM
+        @param source source address within enc memory
+        @param num number of bytes to copy
+        @param sum sum to add to (see Checksum)
+        @return <i>uint32_t</i> new sum
+        @note  The block must start at an even offset of the checksummed range
+     */
+    static uint32_t memcpy_from_enc_sum(void* dest, uint16_t source, int16_t num, uint32_t sum);
 };
 
 typedef ENC28J60 Ethernet; //!< Define alias Ethernet for ENC28J60
@@ -0,0 +1,112 @@
+// Reassembly of fragmented IPv4 datagrams in enc memory
+//
+// Fragments are copied by the ENC28J60 DMA engine from the receive buffer
+// into a slot reserved with enc_malloc(), so a datagram may be larger than
+// the Arduino's buffer, up to ETHERCARD_IPFRAG_SIZE bytes of payload.
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "EtherCard.h"
+#include "net.h"
+
+#define gPB ether.buffer
+
+#define IPFRAG_SLOTS 1      // datagrams that can be reassembled at the same time
+#define IPFRAG_SIZE (ETHERCARD_IPFRAG_SIZE & ~7) // largest datagram payload, a multiple of 8
+#define IPFRAG_TIMEOUT 5000 // ms before an incomplete datagram is dropped
+
+#define IPFRAG_HDR (ETH_HEADER_LEN+IP_HEADER_LEN)
+#define IPFRAG_UNITS (IPFRAG_SIZE/8) // fragment offsets count in 8 byte units
+#define IP_MF_V 0x20
+
+typedef struct {
+    uint8_t proto;          // IP protocol, 0 if slot is free
+    uint8_t id[2];          // IP identification
+    uint8_t src[IP_LEN];    // sender of the datagram
+    uint16_t total;         // payload length, 0 until the last fragment arrived
+    unsigned long started;  // millis() of the first fragment
+    uint8_t map[(IPFRAG_UNITS+7)/8]; // units received so far
+} IpFragSlot;
+
+static IpFragSlot slots[IPFRAG_SLOTS];
+static uint16_t region; // enc address of the slots, 0 until allocated
+
+void EtherCard::ipFragExpire() {
+    unsigned long now = millis();
+    for (IpFragSlot* s = slots; s < slots + IPFRAG_SLOTS; ++s)
+        if (s->proto != 0 && now - s->started >= IPFRAG_TIMEOUT)
+            s->proto = 0; // timed out, a fragment got lost
+}
+
+static IpFragSlot* find_slot(unsigned long now) {
+    EtherCard::ipFragExpire();
+    IpFragSlot* free = 0;
+    for (IpFragSlot* s = slots; s < slots + IPFRAG_SLOTS; ++s) {
+        if (s->proto == 0) {
+            if (free == 0)
+                free = s;
+        } else if (s->proto == gPB[IP_PROTO_P] &&
+                   memcmp(s->id, gPB + IP_ID_H_P, 2) == 0 &&
+                   memcmp(s->src, gPB + IP_SRC_P, IP_LEN) == 0)
+            return s;
+    }
+    if (free != 0) {
+        free->proto = gPB[IP_PROTO_P];
+        memcpy(free->id, gPB + IP_ID_H_P, 2);
+        EtherCard::copyIp(free->src, gPB + IP_SRC_P);
+        free->total = 0;
+        free->started = now;
+        memset(free->map, 0, sizeof free->map);
+    }
+    return free;
+}
+
+static bool is_complete(const IpFragSlot* s) {
+    if (s->total == 0)
+        return false;
+    for (uint16_t u = 0; u < (s->total+7)/8; ++u)
+        if ((s->map[u>>3] & (1<<(u&7))) == 0)
+            return false;
+    return true;
+}
+
+uint16_t EtherCard::ipReassemble(uint16_t len) {
+    if (region == 0 && (region = enc_malloc(IPFRAG_SLOTS * (IPFRAG_HDR+IPFRAG_SIZE))) == 0)
+        return 0; // no room in enc memory, see ETHERCARD_IPFRAG
+
+    uint16_t offset = (((gPB[IP_FLAGS_P] & 0x1f) << 8) | gPB[IP_FLAGS_P+1]) * 8;
+    uint16_t flen = ((gPB[IP_TOTLEN_H_P] << 8) | gPB[IP_TOTLEN_L_P]) - IP_HEADER_LEN;
+    bool last = (gPB[IP_FLAGS_P] & IP_MF_V) == 0;
+
+    IpFragSlot* s = find_slot(millis());
+    if (s == 0)
+        return 0; // all slots busy
+    if (offset > IPFRAG_SIZE || flen > IPFRAG_SIZE - offset || (!last && (flen & 7))) {
+        s->proto = 0; // datagram too large or fragment malformed
+        return 0;
+    }
+
+    uint16_t addr = region + (s - slots) * (IPFRAG_HDR+IPFRAG_SIZE);
+    if (offset == 0)
+        packetSliceToEnc(addr, 0, IPFRAG_HDR+flen); // first fragment brings the headers
+    else
+        packetSliceToEnc(addr+IPFRAG_HDR+offset, IPFRAG_HDR, flen);
+    for (uint16_t u = offset/8; u < (offset+flen+7)/8; ++u)
+        s->map[u>>3] |= 1<<(u&7);
+    if (last)
+        s->total = offset+flen;
+    if (!is_complete(s))
+        return 0;
+
+    // deliver the datagram as if it was received in one packet
+    s->proto = 0;
+    len = IPFRAG_HDR + s->total;
+    uint16_t n = len < bufferSize-1 ? len : bufferSize-1;
+    memcpy_from_enc(gPB, addr, n);
+    gPB[n] = 0;
+    gPB[IP_TOTLEN_H_P] = (IP_HEADER_LEN+s->total) >> 8;
+    gPB[IP_TOTLEN_L_P] = IP_HEADER_LEN+s->total;
+    packetSliceSource(addr, len);
+    return n;
+}
@@ -0,0 +1,160 @@
+// IPv4 link-local address autoconfiguration (RFC 3927)
+//
+// While DHCP has no lease after retransmitting its first message, an address
+// in 169.254/16 is probed with ARP and claimed if no other host uses it. A
+// DHCP lease replaces it.
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "EtherCard.h"
+#include "net.h"
+
+#define gPB ether.buffer
+
+// timing in ms (RFC 3927 section 9)
+#define PROBE_WAIT 1000         // random delay before the first probe
+#define PROBE_NUM 3
+#define PROBE_MIN 1000          // random delay between probes
+#define PROBE_MAX 2000
+#define ANNOUNCE_WAIT 2000      // after the last probe, then the address is ours
+#define ANNOUNCE_NUM 2
+#define ANNOUNCE_INTERVAL 2000
+#define MAX_CONFLICTS 10        // then only probe once a minute
+#define RATE_LIMIT_INTERVAL 60000
+#define DEFEND_INTERVAL 10000   // a second conflict within this time gives up the address
+
+enum {
+    LL_OFF,                     // DHCP has a lease, or nothing started yet
+    LL_PROBING,
+    LL_ANNOUNCING,
+    LL_CLAIMED,
+};
+
+static uint8_t state = LL_OFF;
+static uint8_t count;           // probes or announcements sent
+static uint8_t conflicts;
+static uint8_t candidate[2];    // last two bytes of 169.254.x.y
+static uint16_t wait;           // ms after timer for the next step
+static uint32_t timer;
+static uint32_t defended;       // millis() of the last defence, 0 for none
+static const uint8_t zero[IP_LEN] = { 0 };
+
+static void candidateIp (uint8_t *ip) {
+    ip[0] = 169;
+    ip[1] = 254;
+    ip[2] = candidate[0];
+    ip[3] = candidate[1];
+}
+
+// 169.254.1.0 to 169.254.254.255, the first and last 256 are reserved
+static void pickCandidate () {
+    candidate[0] = 1 + EtherCard::randomBelow(254);
+    candidate[1] = EtherCard::randomBelow(256);
+}
+
+// derived from the MAC address alone, so the same address is tried first after every boot
+static void firstCandidate () {
+    uint16_t h = 0;
+    for (uint8_t i = 0; i < ETH_LEN; ++i)
+        h = (h << 5) + h + EtherCard::mymac[i];
+    candidate[0] = 1 + (h >> 8) % 254;
+    candidate[1] = h;
+}
+
+static void restart (uint16_t delay) {
+    state = LL_PROBING;
+    count = 0;
+    timer = millis();
+    wait = conflicts >= MAX_CONFLICTS ? RATE_LIMIT_INTERVAL : delay;
+}
+
+static void conflict () {
+    if (conflicts < MAX_CONFLICTS)
+        ++conflicts;
+    pickCandidate();
+    restart(EtherCard::randomBelow(PROBE_WAIT));
+}
+
+static bool isCandidate (const uint8_t *ip) {
+    return ip[0] == 169 && ip[1] == 254 && ip[2] == candidate[0] && ip[3] == candidate[1];
+}
+
+bool EtherCard::isLinkLocal () {
+    return state == LL_ANNOUNCING || state == LL_CLAIMED;
+}
+
+void EtherCard::linkLocalStateMachine (uint16_t len) {
+    if (dhcpBound()) {
+        state = LL_OFF; // the lease replaced the address
+        return;
+    }
+    if (!isLinkUp())
+        return;
+
+    if (len > 0) {
+        // any ARP packet from another host may reveal a conflict (section 2.2.1 and 2.5)
+        if (len < 42 || gPB[ETH_TYPE_H_P] != ETHTYPE_ARP_H_V || gPB[ETH_TYPE_L_P] != ETHTYPE_ARP_L_V ||
+                memcmp(gPB + ETH_ARP_SRC_MAC_P, mymac, ETH_LEN) == 0)
+            return;
+        const uint8_t *sender = gPB + ETH_ARP_SRC_IP_P;
+        const uint8_t *target = gPB + ETH_ARP_DST_IP_P;
+        if (state == LL_PROBING) {
+            // somebody uses the address, or probes for it as well
+            if (isCandidate(sender) || (memcmp(sender, zero, IP_LEN) == 0 && isCandidate(target)))
+                conflict();
+        } else if (state != LL_OFF && isCandidate(sender)) {
+            if (defended != 0 && millis() - defended < DEFEND_INTERVAL) {
+                memset(myip, 0, IP_LEN); // give up the address
+                networkEvent(NET_LOST);
+                conflict();
+            } else {
+                defended = millis();
+                count = ANNOUNCE_NUM - 1; // defend with one announcement
+                state = LL_ANNOUNCING;
+                wait = 0;
+                timer = millis();
+            }
+        }
+        return; // packets are only sent when idle, the received one is still needed
+    }
+
+    if (state == LL_OFF) {
+        if (dhcpTries < 2)
+            return; // give the DHCP server time to answer a retransmission first
+        if (candidate[0] == 0)
+            firstCandidate();
+        restart(randomBelow(PROBE_WAIT));
+        return;
+    }
+    if (state == LL_CLAIMED || millis() - timer < wait)
+        return;
+
+    uint8_t ip[IP_LEN];
+    candidateIp(ip);
+    timer = millis();
+    if (state == LL_PROBING) {
+        if (count < PROBE_NUM) {
+            arpRequest(ip, zero); // a probe, from 0.0.0.0
+            ++count;
+            wait = count < PROBE_NUM ? PROBE_MIN + randomBelow(PROBE_MAX - PROBE_MIN) : ANNOUNCE_WAIT;
+            return;
+        }
+        // nobody answered, the address is ours
+        copyIp(myip, ip);
+        static const uint8_t mask[IP_LEN] = { 255, 255, 0, 0 };
+        copyIp(netmask, mask);
+        memset(gwip, 0, IP_LEN); // other hosts are on the link
+        updateBroadcastAddress();
+        conflicts = 0;
+        defended = 0;
+        count = 0;
+        state = LL_ANNOUNCING;
+        networkEvent(NET_ADDRESS);
+        networkEvent(NET_READY);
+    }
+    arpRequest(ip, ip);
+    wait = ANNOUNCE_INTERVAL;
+    if (++count >= ANNOUNCE_NUM)
+        state = LL_CLAIMED;
+}
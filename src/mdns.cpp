@@ -0,0 +1,349 @@
+// Multicast DNS responder (RFC 6762) with DNS-SD service records (RFC 6763)
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "EtherCard.h"
+#include "net.h"
+
+#define gPB ether.buffer
+
+#define MDNS_PORT 5353
+#define MDNS_TTL 120            // seconds, for all our records (RFC 6762 section 10)
+#define MDNS_LEGACY_TTL 10      // in answers to one-shot queries (section 6.7)
+#define MDNS_NAME_MAX 80        // longest name we make, dots included
+#define MDNS_TXT_MAX 63         // longest TXT record we send
+#define MDNS_RECORD_MAX (2 * MDNS_NAME_MAX + 20) // room taken by one record at most
+#define MDNS_HOPS_MAX 16        // compression pointers followed in a name, against loops
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_SRV 33
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define MDNS_CACHE_FLUSH 0x80   // class bit of records only we own (section 10.2)
+#define MDNS_QU 0x80            // class bit of a question that wants a unicast answer (section 5.4)
+
+// the names we answer for
+#define NAME_HOST 0             // host.local
+#define NAME_SERVICE 1          // _http._tcp.local
+#define NAME_INSTANCE 2         // host._http._tcp.local
+#define NAME_ENUM 3             // _services._dns-sd._udp.local
+
+// Records are picked as bits in a word: bit 0 is the address of the host,
+// then come four bits for each service.
+#define REC_PTR 0               // service to instance
+#define REC_SRV 1
+#define REC_TXT 2
+#define REC_ENUM 3              // enumeration to service
+#define REC(s, r) (1 << (1 + 4 * (s) + (r)))
+#define REC_A 1
+
+#if ETHERCARD_MDNS_SERVICES > 3
+#error "The mDNS responder supports 3 services at most"
+#endif
+
+typedef struct {
+    const char* type;       // in program space
+    const char* txt;        // in program space, 0 for an empty TXT record
+    uint16_t port;
+} MdnsService;
+
+static const char* host;    // our name without .local, 0 until mdnsBegin()
+static bool hostFromRam;
+static MdnsService services[ETHERCARD_MDNS_SERVICES];
+static uint8_t numServices;
+
+static const uint8_t mdnsip[IP_LEN] = { 224,0,0,251 };
+static const char local_P[] PROGMEM = "local";
+static const char enum_P[] PROGMEM = "_services._dns-sd._udp";
+
+static char* append (char* buf, char* d, const char* s, bool ram, const char* limit) {
+    if (d != buf && d < limit)
+        *d++ = '.';
+    for (;;) {
+        char c = ram ? *s : pgm_read_byte(s);
+        if (c == 0 || d >= limit)
+            break;
+        *d++ = c;
+        ++s;
+    }
+    *d = 0;
+    return d;
+}
+
+// a name as a dotted string, buf needs MDNS_NAME_MAX bytes
+static void makeName (char* buf, uint8_t kind, uint8_t s) {
+    const char* limit = buf + MDNS_NAME_MAX - sizeof local_P - 1;
+    char* d = buf;
+    if (kind == NAME_HOST || kind == NAME_INSTANCE)
+        d = append(buf, d, host, hostFromRam, limit);
+    if (kind == NAME_SERVICE || kind == NAME_INSTANCE)
+        d = append(buf, d, services[s].type, false, limit);
+    if (kind == NAME_ENUM)
+        d = append(buf, d, enum_P, false, limit);
+    append(buf, d, local_P, false, buf + MDNS_NAME_MAX - 1);
+}
+
+// skip a name in a message, returns 0 if it runs past the end
+static const byte* skipName (const byte* p, const byte* end) {
+    while (p < end) {
+        if ((*p & 0xC0) == 0xC0)
+            return p + 2;
+        if (*p == 0)
+            return p + 1;
+        p += *p + 1;
+    }
+    return 0;
+}
+
+static char lower (char c) {
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// compare the name at p in the message with a dotted name, ignoring case
+static bool isName (const byte* msg, const byte* p, const byte* end, const char* name) {
+    uint8_t hops = 0;
+    for (;;) {
+        while (p + 1 < end && (*p & 0xC0) == 0xC0) {
+            if (++hops > MDNS_HOPS_MAX)
+                return false;
+            p = msg + (((p[0] & 0x3F) << 8) | p[1]);
+        }
+        if (p >= end || p + *p >= end)
+            return false;
+        uint8_t n = *p++;
+        if (n == 0)
+            return *name == 0;
+        while (n-- > 0)
+            if (*name == 0 || lower(*p++) != lower(*name++))
+                return false;
+        if (*name == '.')
+            ++name;
+        else if (*name != 0)
+            return false;
+    }
+}
+
+static byte* putName (byte* w, const char* name) {
+    for (;;) {
+        byte* len = w++;
+        while (*name != 0 && *name != '.')
+            *w++ = *name++;
+        *len = w - len - 1;
+        if (*name++ == 0)
+            break;
+    }
+    *w++ = 0;
+    return w;
+}
+
+static byte* putRecord (byte* w, uint8_t bit, uint16_t ttl, bool legacy) {
+    char name[MDNS_NAME_MAX];
+    uint8_t s = (bit - 1) / 4;
+    uint8_t r = (bit - 1) % 4;
+    uint8_t type = DNS_TYPE_A;
+    bool unique = true; // PTR records are shared with other hosts
+    if (bit == 0)
+        makeName(name, NAME_HOST, 0);
+    else if (r == REC_PTR || r == REC_ENUM) {
+        makeName(name, r == REC_PTR ? NAME_SERVICE : NAME_ENUM, s);
+        type = DNS_TYPE_PTR;
+        unique = false;
+    } else {
+        makeName(name, NAME_INSTANCE, s);
+        type = r == REC_SRV ? DNS_TYPE_SRV : DNS_TYPE_TXT;
+    }
+    w = putName(w, name);
+    *w++ = 0;
+    *w++ = type;
+    *w++ = unique && !legacy ? MDNS_CACHE_FLUSH : 0;
+    *w++ = DNS_CLASS_IN;
+    *w++ = 0;
+    *w++ = 0;
+    *w++ = ttl >> 8;
+    *w++ = ttl;
+    byte* rdata = w + 2;
+    w = rdata;
+    if (bit == 0) {
+        EtherCard::copyIp(w, EtherCard::myip);
+        w += IP_LEN;
+    } else if (r == REC_PTR || r == REC_ENUM) {
+        makeName(name, r == REC_PTR ? NAME_INSTANCE : NAME_SERVICE, s);
+        w = putName(w, name);
+    } else if (r == REC_SRV) {
+        memset(w, 0, 4); // priority and weight
+        w[4] = services[s].port >> 8;
+        w[5] = services[s].port;
+        makeName(name, NAME_HOST, 0);
+        w = putName(w + 6, name);
+    } else {
+        // a TXT record has at least one string, which may be empty (RFC 6763 section 6.1)
+        uint8_t n = 0;
+        if (services[s].txt != 0) {
+            n = strlen_P(services[s].txt);
+            if (n > MDNS_TXT_MAX)
+                n = MDNS_TXT_MAX;
+            memcpy_P(w + 1, services[s].txt, n);
+        }
+        *w = n;
+        w += n + 1;
+    }
+    rdata[-2] = (w - rdata) >> 8;
+    rdata[-1] = w - rdata;
+    return w;
+}
+
+// add the records in the bits of answer, then the additional ones of extra, to a response
+static byte* putRecords (byte* msg, byte* w, uint16_t answer, uint16_t extra, bool legacy) {
+    const byte* limit = gPB + EtherCard::bufferSize - MDNS_RECORD_MAX;
+    uint16_t ttl = legacy ? MDNS_LEGACY_TTL : MDNS_TTL;
+    msg[2] = 0x84; // response, authoritative
+    msg[3] = 0;
+    memset(msg + 6, 0, 6);
+    for (uint8_t i = 0; i < 32; ++i) {
+        uint8_t bit = i % 16;
+        if (w > limit)
+            break; // the rest does not fit into the buffer
+        if ((i < 16 ? answer : extra) & (1 << bit)) {
+            w = putRecord(w, bit, ttl, legacy);
+            msg[i < 16 ? 7 : 11]++;
+        }
+    }
+    return w;
+}
+
+// like udpTransmit(), with the IP TTL of 255 that RFC 6762 section 11 asks for
+static void mdnsTransmit (uint16_t datalen) {
+    uint16_t udplen = UDP_HEADER_LEN + datalen;
+    uint16_t totlen = IP_HEADER_LEN + udplen;
+    gPB[IP_TOTLEN_H_P] = totlen >> 8;
+    gPB[IP_TOTLEN_L_P] = totlen;
+    gPB[IP_FLAGS_P] = 0x40; // don't fragment
+    gPB[IP_FLAGS_P+1] = 0;
+    gPB[IP_TTL_P] = 255;
+    gPB[IP_CHECKSUM_P] = 0;
+    gPB[IP_CHECKSUM_P+1] = 0;
+    uint16_t check = Checksum::fold(Checksum::add(gPB + IP_P, IP_HEADER_LEN));
+    gPB[IP_CHECKSUM_P] = check >> 8;
+    gPB[IP_CHECKSUM_P+1] = check;
+    gPB[UDP_LEN_H_P] = udplen >> 8;
+    gPB[UDP_LEN_L_P] = udplen;
+    gPB[UDP_CHECKSUM_H_P] = 0;
+    gPB[UDP_CHECKSUM_L_P] = 0;
+    check = Checksum::fold(Checksum::add(gPB + IP_SRC_P, 2*IP_LEN + udplen, IP_PROTO_UDP_V + udplen));
+    if (check == 0)
+        check = 0xFFFF; // zero means no checksum (RFC 768)
+    gPB[UDP_CHECKSUM_H_P] = check >> 8;
+    gPB[UDP_CHECKSUM_L_P] = check;
+    EtherCard::packetSend(ETH_HEADER_LEN + totlen);
+}
+
+static void mdnsReceive (uint16_t /*port*/, uint8_t src_ip[IP_LEN], uint16_t src_port, const char *data, uint16_t len) {
+    byte* msg = (byte*) data;
+    const byte* end = msg + len;
+    if (end > gPB + EtherCard::bufferSize)
+        end = gPB + EtherCard::bufferSize;
+    if (end < msg + 12 || (msg[2] & 0xF8) != 0 || msg[4] != 0)
+        return; // not a standard query
+    bool legacy = src_port != MDNS_PORT; // a one-shot query from a plain resolver
+    bool unicast = legacy;
+    uint16_t answer = 0, extra = 0;
+    char name[MDNS_NAME_MAX];
+    const byte* p = msg + 12;
+    for (uint8_t i = 0; i < msg[5]; ++i) {
+        const byte* qname = p;
+        p = skipName(p, end);
+        if (p == 0 || p + 4 > end)
+            return;
+        uint8_t type = p[0] == 0 ? p[1] : 0;
+        bool any = type == DNS_TYPE_ANY;
+        if (p[2] & MDNS_QU)
+            unicast = true;
+        p += 4;
+        makeName(name, NAME_HOST, 0);
+        if ((any || type == DNS_TYPE_A) && isName(msg, qname, end, name))
+            answer |= REC_A;
+        makeName(name, NAME_ENUM, 0);
+        bool enumerate = (any || type == DNS_TYPE_PTR) && isName(msg, qname, end, name);
+        for (uint8_t s = 0; s < numServices; ++s) {
+            if (enumerate)
+                answer |= REC(s, REC_ENUM);
+            makeName(name, NAME_SERVICE, s);
+            if ((any || type == DNS_TYPE_PTR) && isName(msg, qname, end, name)) {
+                answer |= REC(s, REC_PTR);
+                extra |= REC(s, REC_SRV) | REC(s, REC_TXT) | REC_A;
+            }
+            makeName(name, NAME_INSTANCE, s);
+            if (isName(msg, qname, end, name)) {
+                if (any || type == DNS_TYPE_SRV) {
+                    answer |= REC(s, REC_SRV);
+                    extra |= REC_A;
+                }
+                if (any || type == DNS_TYPE_TXT)
+                    answer |= REC(s, REC_TXT);
+            }
+        }
+    }
+    if (answer == 0)
+        return;
+
+    uint8_t dip[IP_LEN];
+    EtherCard::copyIp(dip, unicast ? src_ip : mdnsip);
+    uint16_t dport = unicast ? src_port : MDNS_PORT;
+    uint8_t dmac[ETH_LEN];
+    EtherCard::copyMac(dmac, gPB + ETH_SRC_MAC); // the querier, or the router it is behind
+    byte* w;
+    if (legacy) {
+        w = (byte*) p; // the ID and the questions go back to the resolver
+    } else {
+        msg[0] = 0;
+        msg[1] = 0;
+        msg[5] = 0;
+        w = msg + 12;
+    }
+    w = putRecords(msg, w, answer, extra & ~answer, legacy);
+    EtherCard::udpPrepare(MDNS_PORT, dip, dport);
+    if (unicast)
+        EtherCard::copyMac(gPB + ETH_DST_MAC, dmac); // udpPrepare would use the last ARP'd host
+    mdnsTransmit(w - msg);
+}
+
+bool EtherCard::mdnsBegin (const char* name, bool fromRam) {
+    if (name == NULL) {
+        name = dhcpHostname();
+        fromRam = true;
+    }
+    host = name;
+    hostFromRam = fromRam;
+    enableMulticast();
+    udpServerStopListenOnPort(MDNS_PORT);
+    if (!udpServerListenOnPort(mdnsReceive, MDNS_PORT))
+        return false;
+    mdnsAnnounce();
+    return true;
+}
+
+bool EtherCard::mdnsAddService (const char* type, uint16_t port, const char* txt) {
+    if (numServices >= ETHERCARD_MDNS_SERVICES)
+        return false;
+    services[numServices].type = type;
+    services[numServices].txt = txt;
+    services[numServices].port = port;
+    numServices++;
+    return true;
+}
+
+void EtherCard::mdnsAnnounce () {
+    if (host == 0 || myip[0] == 0)
+        return; // not started, or no address yet
+    uint16_t answer = REC_A;
+    for (uint8_t s = 0; s < numServices; ++s)
+        answer |= REC(s, REC_PTR) | REC(s, REC_SRV) | REC(s, REC_TXT);
+    byte* msg = gPB + UDP_DATA_P;
+    memset(msg, 0, 12);
+    byte* w = putRecords(msg, msg + 12, answer, 0, false);
+    udpPrepare(MDNS_PORT, mdnsip, MDNS_PORT);
+    mdnsTransmit(w - msg);
+}
@@ -69,6 +69,8 @@
 #define IP_P 0xe
 #define IP_TOTLEN_H_P 0x10
 #define IP_TOTLEN_L_P 0x11
+#define IP_ID_H_P 0x12
+#define IP_ID_L_P 0x13
 
 #define IP_PROTO_P 0x17
 
@@ -90,6 +92,7 @@
 
 // ******* UDP *******
 #define UDP_HEADER_LEN    8
+#define UDP_PAYLOAD_MAX   (1500-IP_HEADER_LEN-UDP_HEADER_LEN) // largest payload with a 1500 byte MTU
 //
 #define UDP_SRC_PORT_H_P 0x22
 #define UDP_SRC_PORT_L_P 0x23
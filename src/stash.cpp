@@ -10,21 +10,36 @@
 //#define FLOATEMIT // uncomment line to enable $T in emit_P for float emitting
 
 byte Stash::map[SCRATCH_MAP_SIZE];
+uint8_t Stash::mapFirst;
+uint8_t Stash::freeBlocks;
 Stash::Block Stash::bufs[BUFCOUNT];
 
+// lowest set bit of a nibble
+static const uint8_t lowestBit[16] PROGMEM = { 0,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0 };
+
+// map bytes before mapFirst are all zero, so the scan for a free block
+// starts at the first byte with one and finds its lowest bit by table
 uint8_t Stash::allocBlock () {
-    for (uint8_t i = 0; i < sizeof map; ++i)
-        if (map[i] != 0)
-            for (uint8_t j = 0; j < 8; ++j)
-                if (bitRead(map[i], j)) {
-                    bitClear(map[i], j);
-                    return (i << 3) + j;
-                }
-    return 0;
+    if (freeBlocks == 0)
+        return 0;
+    while (map[mapFirst] == 0)
+        ++mapFirst;
+    uint8_t bits = map[mapFirst];
+    uint8_t j = (bits & 0x0F) != 0 ? 0 : 4;
+    j += pgm_read_byte(lowestBit + ((bits >> j) & 0x0F));
+    bitClear(map[mapFirst], j);
+    --freeBlocks;
+    return (mapFirst << 3) + j;
 }
 
 void Stash::freeBlock (uint8_t block) {
-    bitSet(map[block>>3], block & 7);
+    uint8_t i = block >> 3;
+    if (!bitRead(map[i], block & 7)) {
+        bitSet(map[i], block & 7);
+        ++freeBlocks;
+        if (i < mapFirst)
+            mapFirst = i;
+    }
 }
 
 uint8_t Stash::fetchByte (uint8_t blk, uint8_t off) {
@@ -59,12 +74,7 @@ void Stash::load (uint8_t idx, uint8_t blk) {
 }
 
 uint8_t Stash::freeCount () {
-    uint8_t count = 0;
-    for (uint8_t i = 0; i < sizeof map; ++i)
-        for (uint8_t m = 0x80; m != 0; m >>= 1)
-            if (map[i] & m)
-                ++count;
-    return count;
+    return freeBlocks;
 }
 
 // create a new stash; make it the active stash; return the first block as a handle
@@ -135,6 +145,26 @@ uint16_t Stash::size () {
     return 63 * count + fetchByte(last, 62) - sizeof (StashHeader);
 }
 
+// copy the content to other enc memory with the DMA engine, without passing
+// it through the Arduino; the write buffer is written back first
+uint16_t Stash::copyToEnc (uint16_t dest, uint16_t maxlen) {
+    ether.copyout(bufs[WRITEBUF].bnum, bufs[WRITEBUF].bytes);
+    uint16_t done = 0;
+    uint8_t blk = first, pos = sizeof (StashHeader);
+    while (done < maxlen) {
+        uint16_t n = (blk == last ? fetchByte(blk, 62) : 63) - pos;
+        if (n > maxlen - done)
+            n = maxlen - done;
+        ether.memcpy_within_enc(dest + done, SCRATCH_START + (blk << SCRATCH_PAGE_SHIFT) + pos, n);
+        done += n;
+        if (blk == last)
+            break;
+        blk = fetchByte(blk, 63);
+        pos = 0;
+    }
+    return done;
+}
+
 // write information about the fmt string and the arguments into special page/block 0
 // block 0 is initially marked as allocated and never returned by allocateBlock
 void Stash::prepare (const char* fmt PROGMEM, ...) {
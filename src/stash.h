@@ -35,6 +35,8 @@ class Stash : public /*Stream*/ Print, private StashHeader {
 
     static Block bufs[2];
     static uint8_t map[SCRATCH_MAP_SIZE];
+    static uint8_t mapFirst;   //!< First byte of map that may have a free block
+    static uint8_t freeBlocks; //!< Number of bits set in map
 
 public:
     static void initMap (uint8_t last=SCRATCH_PAGE_NUM);
@@ -52,6 +54,7 @@ public:
     void put (char c);
     char get ();
     uint16_t size ();
+    uint16_t copyToEnc (uint16_t dest, uint16_t maxlen);
 
     virtual WRITE_RESULT write(uint8_t b) { put(b); WRITE_RETURN }
 
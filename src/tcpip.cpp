@@ -49,9 +49,11 @@ static const char *client_urlbuf; // Pointer to c-string path part of HTTP reque
 static const char *client_urlbuf_var; // Pointer to c-string filename part of HTTP request URL
 static const char *client_hoststr; // Pointer to c-string hostname of current HTTP request
 static void (*icmp_cb)(uint8_t *ip); // Pointer to callback function for ICMP ECHO response handler (triggers when localhost receives ping response (pong))
+static NetworkCallback network_cb; // Pointer to callback function for NET_ADDRESS, NET_READY and NET_LOST
 static uint8_t destmacaddr[ETH_LEN]; // storing both dns server and destination mac addresses, but at different times because both are never needed at same time.
 static boolean waiting_for_dns_mac = false; //might be better to use bit flags and bitmask operations for these conditions
 static boolean has_dns_mac = false;
+static uint8_t dns_mac_ip[IP_LEN]; // the dnsip that has_dns_mac is about, the resolver may switch servers
 static boolean waiting_for_dest_mac = false;
 static boolean has_dest_mac = false;
 static uint8_t gwmacaddr[ETH_LEN]; // Hardware (MAC) address of gateway router
@@ -68,7 +70,21 @@ static uint8_t result_fd = 123; // Session id of last reply
 static const char* result_ptr; // Pointer to TCP/IP data
 static unsigned long SEQ; // TCP/IP sequence number
 
-#define CLIENTMSS 550
+// largest TCP payload in a frame with a 1500 byte MTU, see MAX_FRAMELEN
+#define TCP_MSS_MAX (1500-IP_HEADER_LEN-TCP_HEADER_LEN_PLAIN)
+#define TCP_MSS_DEFAULT 536 // RFC 1122, assumed when the peer sends no MSS option
+#define TCP_OPT_MSS_V 2
+// The MSS a peer announces in its SYN is kept as an index into this table in
+// bits 5..7 of our initial sequence number (bits 26..28 with SYN cookies), so
+// accept() can recover it from the acknowledgement number of the request.
+static const uint16_t mss_table[] PROGMEM = { 128, 256, 400, 536, 1024, 1220, 1400, 1460 };
+static uint16_t peer_mss = TCP_MSS_DEFAULT; // MSS of the peer of the connection currently being answered
+
+// RST replies, and SYN+ACKs without SYN cookies, are paced by a token bucket, so a flood or port scan cannot keep packetLoop busy transmitting
+#define TCP_REPLY_RATE 10  // replies per second in the long run
+#define TCP_REPLY_BURST 4  // replies allowed back to back
+static uint8_t reply_tokens = TCP_REPLY_BURST;
+static unsigned long reply_refill; // time the bucket was last refilled
 #define TCP_DATA_START ((uint16_t)TCP_SRC_PORT_H_P+(gPB[TCP_HEADER_LEN_P]>>4)*4) // Get offset of TCP/IP payload data
 
 const unsigned char arpreqhdr[] PROGMEM = { 0,1,8,0,6,4,0,1 }; // ARP request header
@@ -76,22 +92,40 @@ const unsigned char iphdr[] PROGMEM = { 0x45,0,0,0x82,0,0,0x40,0,0x20 }; //IP he
 const unsigned char ntpreqhdr[] PROGMEM = { 0xE3,0,4,0xFA,0,1,0,0,0,1 }; //NTP request header
 extern const uint8_t allOnes[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }; // Used for hardware (MAC) and IP broadcast addresses
 
+static uint16_t get16(uint8_t pos) {
+    return (gPB[pos] << 8) | gPB[pos+1];
+}
+
+static void put16(uint8_t pos, uint16_t v) {
+    gPB[pos] = v >> 8;
+    gPB[pos+1] = v;
+}
+
 static void fill_checksum(uint8_t dest, uint8_t off, uint16_t len,uint8_t type) {
-    const uint8_t* ptr = gPB + off;
     uint32_t sum = type==1 ? IP_PROTO_UDP_V+len-8 :
                    type==2 ? IP_PROTO_TCP_V+len-8 : 0;
-    while(len >1) {
-        sum += (uint16_t) (((uint32_t)*ptr<<8)|*(ptr+1));
-        ptr+=2;
-        len-=2;
-    }
-    if (len)
-        sum += ((uint32_t)*ptr)<<8;
-    while (sum>>16)
-        sum = (uint16_t) sum + (sum >> 16);
-    uint16_t ck = ~ (uint16_t) sum;
-    gPB[dest] = ck>>8;
-    gPB[dest+1] = ck;
+    put16(dest, Checksum::fold(Checksum::add(gPB + off, len, sum)));
+}
+
+// Incremental checksum update (RFC 1624) for frames changed in place: the
+// Checksum::change() terms of all changed words are added up and applied to
+// the checksum with csum_apply(). This relies on the received checksum being valid.
+static void csum_apply(uint8_t dest, uint32_t sum) {
+    put16(dest, Checksum::fold(sum + (uint16_t) ~get16(dest)));
+}
+
+// replace the word at pos and adjust the checksum at dest
+static void csum_replace(uint8_t dest, uint8_t pos, uint16_t now) {
+    csum_apply(dest, Checksum::change(get16(pos), now));
+    put16(pos, now);
+}
+
+// change to the sum of the address pair when a reply swaps source and
+// destination: nothing, unless the request went to a broadcast address
+static uint32_t reply_address_change() {
+    const uint8_t* ip = EtherCard::myip;
+    return Checksum::change(get16(IP_DST_P), (ip[0] << 8) | ip[1]) +
+           Checksum::change(get16(IP_DST_P+2), (ip[2] << 8) | ip[3]);
 }
 
 static void setMACs (const uint8_t *mac) {
@@ -132,8 +166,8 @@ static uint8_t eth_type_is_ip_and_my_ip(uint16_t len) {
            gPB[IP_HEADER_LEN_VER_P] == 0x45 &&
            (memcmp(gPB + IP_DST_P, EtherCard::myip, IP_LEN) == 0  //not my IP
             || (memcmp(gPB + IP_DST_P, EtherCard::broadcastip, IP_LEN) == 0) //not subnet broadcast
-            || (memcmp(gPB + IP_DST_P, allOnes, IP_LEN) == 0)); //not global broadcasts
-    //!@todo Handle multicast
+            || (memcmp(gPB + IP_DST_P, allOnes, IP_LEN) == 0) //not global broadcasts
+            || ((gPB[IP_DST_P] & 0xF0) == 0xE0 && gPB[IP_PROTO_P] == IP_PROTO_UDP_V)); //not UDP multicast, see enableMulticast()
 }
 
 static void fill_ip_hdr_checksum() {
@@ -145,11 +179,161 @@ static void fill_ip_hdr_checksum() {
     fill_checksum(IP_CHECKSUM_P, IP_P, IP_HEADER_LEN,0);
 }
 
-static void make_eth_ip() {
+// turn the IP header of a received packet into that of the reply, updating its checksum
+static void make_eth_ip(uint16_t totlen) {
     setMACs(gPB + ETH_SRC_MAC);
+    uint32_t sum = reply_address_change() +
+                   Checksum::change(get16(IP_TOTLEN_H_P), totlen) +
+                   Checksum::change(get16(IP_FLAGS_P), 0x4000) + // don't fragment
+                   Checksum::change(get16(IP_TTL_P), (64 << 8) | gPB[IP_PROTO_P]);
+    put16(IP_TOTLEN_H_P, totlen);
+    put16(IP_FLAGS_P, 0x4000);
+    gPB[IP_TTL_P] = 64;
     EtherCard::copyIp(gPB + IP_DST_P, gPB + IP_SRC_P);
     EtherCard::copyIp(gPB + IP_SRC_P, EtherCard::myip);
-    fill_ip_hdr_checksum();
+    csum_apply(IP_CHECKSUM_P, sum);
+}
+
+// MSS we announce: whatever fits into the receive buffer (packetReceive keeps one byte for the terminating zero)
+static uint16_t local_mss() {
+    uint16_t mss = EtherCard::bufferSize - 1 - TCP_OPTIONS_P;
+    return mss < TCP_MSS_MAX ? mss : TCP_MSS_MAX;
+}
+
+// MSS option of a received SYN, or the RFC 1122 default if there is none
+static uint16_t get_mss_option() {
+    uint16_t pos = TCP_OPTIONS_P;
+    uint8_t end = TCP_SRC_PORT_H_P + (gPB[TCP_HEADER_LEN_P]>>4)*4;
+    while (pos + 1 < end) {
+        uint8_t kind = gPB[pos];
+        if (kind == 0)
+            break;
+        if (kind == 1) { // NOP
+            pos++;
+            continue;
+        }
+        if (kind == TCP_OPT_MSS_V && gPB[pos+1] == 4 && pos + 4 <= end)
+            return (gPB[pos+2] << 8) | gPB[pos+3];
+        if (gPB[pos+1] < 2)
+            break;
+        pos += gPB[pos+1];
+    }
+    return TCP_MSS_DEFAULT;
+}
+
+static uint8_t mss_to_index(uint16_t mss) {
+    uint8_t i = sizeof mss_table / sizeof mss_table[0] - 1;
+    while (i > 0 && pgm_read_word(&mss_table[i]) > mss)
+        --i;
+    return i;
+}
+
+#if ETHERCARD_SYNCOOKIES
+static uint32_t cookie_key[4];  // XTEA key, drawn on the first SYN
+static uint32_t cookie_salt[2]; // fresh random value for the current and the previous time slot
+static uint8_t cookie_slot;     // time slot cookie_salt was last renewed for
+
+// Cookies are only enforced while SYNs are being dropped and for a while
+// after, so connections older than a cookie stay usable in normal operation
+#define SYN_FLOOD_HOLD 60000 // milliseconds
+static bool syn_flood;               // set once the reply bucket ran dry on a SYN
+static unsigned long syn_flood_time; // last time it did
+
+static uint32_t random32() {
+    return ((uint32_t) EtherCard::randomBelow(0xFFFF) << 16) ^ EtherCard::randomBelow(0xFFFF) ^ micros();
+}
+
+// XTEA encryption of peer address and both ports, keyed with the secret and the salt of one time slot of about a minute
+static uint32_t cookie_hash(uint8_t slot) {
+    uint32_t v0 = ((uint32_t) gPB[IP_SRC_P] << 24) | ((uint32_t) gPB[IP_SRC_P+1] << 16) | ((uint16_t) gPB[IP_SRC_P+2] << 8) | gPB[IP_SRC_P+3];
+    uint32_t v1 = ((uint32_t) gPB[TCP_SRC_PORT_H_P] << 24) | ((uint32_t) gPB[TCP_SRC_PORT_L_P] << 16) | ((uint16_t) gPB[TCP_DST_PORT_H_P] << 8) | gPB[TCP_DST_PORT_L_P];
+    v1 ^= cookie_salt[slot & 1];
+    v0 ^= slot;
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < 32; ++i) {
+        v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + cookie_key[sum & 3]);
+        sum += 0x9E3779B9UL;
+        v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + cookie_key[(sum >> 11) & 3]);
+    }
+    return v1;
+}
+
+// SYN cookie: time slot in bits 29..31, peer MSS index in bits 26..28 and hash in bits 0..25
+static uint32_t make_cookie(uint8_t mss_index) {
+    uint8_t slot = millis() >> 16;
+    if (cookie_key[0] == 0 && cookie_key[1] == 0) {
+        for (uint8_t i = 0; i < 4; ++i)
+            cookie_key[i] = random32();
+        cookie_salt[(uint8_t) (slot - 1) & 1] = random32();
+        cookie_slot = slot - 1;
+    }
+    if (slot != cookie_slot) {
+        cookie_salt[slot & 1] = random32();
+        cookie_slot = slot;
+    }
+    return ((uint32_t) slot << 29) | ((uint32_t) mss_index << 26) | (cookie_hash(slot) & 0x03FFFFFF);
+}
+
+// Check that isn is a cookie of this or the previous time slot, advanced by
+// less than 64 KB of data sent since. Returns the peer MSS, or 0 if invalid.
+static uint16_t check_cookie(uint32_t isn) {
+    uint8_t slot = millis() >> 16;
+    for (uint8_t i = 0; i < 2; ++i, --slot) {
+        uint32_t d = isn - (((uint32_t) slot << 29) | (cookie_hash(slot) & 0x03FFFFFF));
+        if (d < ((uint32_t) 8 << 26) && (d & 0x03FFFFFF) < 0x10000)
+            return pgm_read_word(&mss_table[d >> 26]);
+    }
+    return 0;
+}
+#else
+// Low 16 bits of the last SYN+ACK sequence numbers, so the MSS is only taken
+// from an acknowledgement that is exactly one of them plus one
+#define SYNACK_ISNS 4
+static uint16_t synack_isn[SYNACK_ISNS];
+static uint8_t synack_next;
+
+static uint16_t isn_to_mss(uint32_t isn) {
+    if ((isn >> 16) == 0)
+        for (uint8_t i = 0; i < SYNACK_ISNS; ++i)
+            if (synack_isn[i] == (uint16_t) isn)
+                return pgm_read_word(&mss_table[(isn >> 5) & 7]);
+    return TCP_MSS_DEFAULT; // reply data was sent since, or not a SYN+ACK of ours
+}
+#endif
+
+static bool take_reply_token() {
+    unsigned long now = millis();
+    unsigned long n = (now - reply_refill) / (1000 / TCP_REPLY_RATE);
+    if (n > 0) {
+        reply_refill += n * (1000 / TCP_REPLY_RATE);
+        reply_tokens = n < (uint8_t) (TCP_REPLY_BURST - reply_tokens) ? reply_tokens + n : TCP_REPLY_BURST;
+    }
+    if (reply_tokens == 0)
+        return false;
+    --reply_tokens;
+    return true;
+}
+
+static void put_mss_option(uint16_t mss) {
+    gPB[TCP_OPTIONS_P] = TCP_OPT_MSS_V;
+    gPB[TCP_OPTIONS_P+1] = 4;
+    gPB[TCP_OPTIONS_P+2] = mss >> 8;
+    gPB[TCP_OPTIONS_P+3] = mss;
+}
+
+static uint32_t getBigEndianLong(byte offs) { //get the sequence number of packets after an ack from GET
+    return (((unsigned long)gPB[offs]*256+gPB[offs+1])*256+gPB[offs+2])*256+gPB[offs+3];
+} //thanks to mstuetz for the missing (unsigned long)
+
+static void setBigEndianLong(byte offs, uint32_t v) {
+    gPB[offs]   = (v & 0xff000000 ) >> 24;
+    gPB[offs+1] = (v & 0xff0000 ) >> 16;
+    gPB[offs+2] = (v & 0xff00 ) >> 8;
+    gPB[offs+3] = (v & 0xff );
+}
+
+static void setSequenceNumber(uint32_t seq) {
+    setBigEndianLong(TCP_SEQ_H_P, seq);
 }
 
 static void step_seq(uint16_t rel_ack_num,uint8_t cp_seq) {
@@ -194,48 +378,78 @@ static void make_arp_answer_from_request() {
 }
 
 static void make_echo_reply_from_request(uint16_t len) {
-    make_eth_ip();
-    gPB[ICMP_TYPE_P] = ICMP_TYPE_ECHOREPLY_V;
-    if (gPB[ICMP_CHECKSUM_P] > (0xFF-0x08))
-        gPB[ICMP_CHECKSUM_P+1]++;
-    gPB[ICMP_CHECKSUM_P] += 0x08;
+    make_eth_ip(get16(IP_TOTLEN_H_P));
+    csum_replace(ICMP_CHECKSUM_P, ICMP_TYPE_P, (ICMP_TYPE_ECHOREPLY_V << 8) | gPB[ICMP_TYPE_P+1]);
     EtherCard::packetSend(len);
 }
 
-void EtherCard::makeUdpReply (const char *data,uint8_t datalen,uint16_t port) {
-    if (datalen>220)
-        datalen = 220;
-    gPB[IP_TOTLEN_H_P] = (IP_HEADER_LEN+UDP_HEADER_LEN+datalen) >>8;
-    gPB[IP_TOTLEN_L_P] = IP_HEADER_LEN+UDP_HEADER_LEN+datalen;
-    make_eth_ip();
+// Add the payload to a UDP datagram whose headers are in the buffer, fill in
+// the UDP length and checksum and send it. A payload that is larger than the
+// buffer is written straight into the transmit buffer of the enc; one in
+// program space is copied there through the payload area of the buffer.
+static void udp_send(const char *data, uint16_t datalen, bool pgm) {
+    put16(UDP_LEN_H_P, UDP_HEADER_LEN+datalen);
+    put16(UDP_CHECKSUM_H_P, 0);
+    uint16_t room = (EtherCard::bufferSize - UDP_DATA_P) & ~1; // even, to keep chunks word aligned
+    if (datalen <= room) {
+        if (pgm)
+            memcpy_P(gPB + UDP_DATA_P, data, datalen);
+        else
+            memcpy(gPB + UDP_DATA_P, data, datalen);
+        fill_checksum(UDP_CHECKSUM_H_P, IP_SRC_P, 16 + datalen,1);
+        EtherCard::packetSend(UDP_DATA_P + datalen);
+        return;
+    }
+    uint32_t sum = IP_PROTO_UDP_V + UDP_HEADER_LEN + datalen;
+    for (uint16_t pos = 0; pos < datalen; pos += room) {
+        uint16_t n = datalen - pos < room ? datalen - pos : room;
+        const void* chunk = data + pos;
+        if (pgm)
+            chunk = memcpy_P(gPB + UDP_DATA_P, data + pos, n);
+        sum = EtherCard::packetWrite(UDP_DATA_P + pos, chunk, n, sum);
+    }
+    put16(UDP_CHECKSUM_H_P, Checksum::fold(Checksum::add(gPB + IP_SRC_P, 16, sum)));
+    EtherCard::packetSend(UDP_DATA_P + datalen, UDP_DATA_P);
+}
+
+static void make_udp_reply(const char *data, uint16_t datalen, uint16_t port, bool pgm) {
+    if (datalen > UDP_PAYLOAD_MAX)
+        datalen = UDP_PAYLOAD_MAX;
+    make_eth_ip(IP_HEADER_LEN+UDP_HEADER_LEN+datalen);
     gPB[UDP_DST_PORT_H_P] = gPB[UDP_SRC_PORT_H_P];
     gPB[UDP_DST_PORT_L_P] = gPB[UDP_SRC_PORT_L_P];
     gPB[UDP_SRC_PORT_H_P] = port>>8;
     gPB[UDP_SRC_PORT_L_P] = port;
-    gPB[UDP_LEN_H_P] = (UDP_HEADER_LEN+datalen) >> 8;
-    gPB[UDP_LEN_L_P] = UDP_HEADER_LEN+datalen;
-    gPB[UDP_CHECKSUM_H_P] = 0;
-    gPB[UDP_CHECKSUM_L_P] = 0;
-    memcpy(gPB + UDP_DATA_P, data, datalen);
-    fill_checksum(UDP_CHECKSUM_H_P, IP_SRC_P, 16 + datalen,1);
-    packetSend(UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen);
+    udp_send(data, datalen, pgm);
+}
+
+void EtherCard::makeUdpReply (const char *data,uint16_t datalen,uint16_t port) {
+    make_udp_reply(data, datalen, port, false);
+}
+
+void EtherCard::makeUdpReply_P (const char *data PROGMEM,uint16_t datalen,uint16_t port) {
+    make_udp_reply(data, datalen, port, true);
 }
 
 static void make_tcp_synack_from_syn() {
-    gPB[IP_TOTLEN_H_P] = 0;
-    gPB[IP_TOTLEN_L_P] = IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+4;
-    make_eth_ip();
+    uint8_t mss_index = mss_to_index(get_mss_option());
+#if ETHERCARD_SYNCOOKIES
+    uint32_t isn = make_cookie(mss_index); // hashed over the SYN before its addresses are swapped
+#endif
+    make_eth_ip(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+4);
     gPB[TCP_FLAGS_P] = TCP_FLAGS_SYNACK_V;
     make_tcphead(1,0);
+#if ETHERCARD_SYNCOOKIES
+    setSequenceNumber(isn);
+#else
     gPB[TCP_SEQ_H_P+0] = 0;
     gPB[TCP_SEQ_H_P+1] = 0;
     gPB[TCP_SEQ_H_P+2] = seqnum;
-    gPB[TCP_SEQ_H_P+3] = 0;
+    gPB[TCP_SEQ_H_P+3] = mss_index << 5;
+    synack_isn[synack_next++ % SYNACK_ISNS] = (seqnum << 8) | (mss_index << 5);
     seqnum += 3;
-    gPB[TCP_OPTIONS_P] = 2;
-    gPB[TCP_OPTIONS_P+1] = 4;
-    gPB[TCP_OPTIONS_P+2] = 0x05;
-    gPB[TCP_OPTIONS_P+3] = 0x0;
+#endif
+    put_mss_option(local_mss());
     gPB[TCP_HEADER_LEN_P] = 0x60;
     gPB[TCP_WIN_SIZE] = 0x5; // 1400=0x578
     gPB[TCP_WIN_SIZE+1] = 0x78;
@@ -252,47 +466,80 @@ uint16_t EtherCard::getTcpPayloadLength() {
     return (uint16_t)i;
 }
 
+// The ACK leaves a header without options and payload in the buffer, with a
+// valid checksum. Data segments are built on it with tcp_set_flags() and
+// tcp_set_seq(), which keep that checksum up to date, so that make_tcp_segment()
+// only has to sum the payload.
 static void make_tcp_ack_from_any(int16_t datlentoack,uint8_t addflags) {
+    // without a received payload to take out, only the changed words are summed
+    bool incremental = EtherCard::getTcpPayloadLength() == 0;
+    uint32_t sum = 0;
+    if (incremental) {
+        uint8_t hlen = (gPB[TCP_HEADER_LEN_P]>>4)*4;
+        for (uint8_t i = TCP_SEQ_H_P; i < TCP_SRC_PORT_H_P+hlen; i += 2)
+            if (i != TCP_CHECKSUM_H_P+2) // urgent pointer stays
+                sum += (uint16_t) ~get16(i); // sequence numbers, flags, window, checksum and dropped options
+        sum += Checksum::change(hlen, TCP_HEADER_LEN_PLAIN) + reply_address_change(); // pseudo header
+    }
     gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|addflags;
     if (addflags!=TCP_FLAGS_RST_V && datlentoack==0)
         datlentoack = 1;
     make_tcphead(datlentoack,1); // no options
-    uint16_t j = IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN;
-    gPB[IP_TOTLEN_H_P] = j>>8;
-    gPB[IP_TOTLEN_L_P] = j;
-    make_eth_ip();
+    make_eth_ip(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN);
     gPB[TCP_WIN_SIZE] = 0x4; // 1024=0x400, 1280=0x500 2048=0x800 768=0x300
     gPB[TCP_WIN_SIZE+1] = 0;
-    fill_checksum(TCP_CHECKSUM_H_P, IP_SRC_P, 8+TCP_HEADER_LEN_PLAIN,2);
+    if (incremental)
+        put16(TCP_CHECKSUM_H_P, Checksum::fold(Checksum::add(gPB + TCP_SEQ_H_P, TCP_CHECKSUM_H_P-TCP_SEQ_H_P, sum)));
+    else
+        fill_checksum(TCP_CHECKSUM_H_P, IP_SRC_P, 8+TCP_HEADER_LEN_PLAIN,2);
     EtherCard::packetSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+ETH_HEADER_LEN);
 }
 
-static void make_tcp_ack_with_data_noflags(uint16_t dlen) {
-    uint16_t j = IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen;
-    gPB[IP_TOTLEN_H_P] = j>>8;
-    gPB[IP_TOTLEN_L_P] = j;
-    fill_ip_hdr_checksum();
-    gPB[TCP_CHECKSUM_H_P] = 0;
-    gPB[TCP_CHECKSUM_L_P] = 0;
-    fill_checksum(TCP_CHECKSUM_H_P, IP_SRC_P, 8+TCP_HEADER_LEN_PLAIN+dlen,2);
+static void tcp_set_flags(uint8_t flags) {
+    csum_replace(TCP_CHECKSUM_H_P, TCP_HEADER_LEN_P, (gPB[TCP_HEADER_LEN_P] << 8) | flags);
+}
+
+static void tcp_set_seq(uint32_t seq) {
+    uint32_t sum = Checksum::change(get16(TCP_SEQ_H_P), seq >> 16) +
+                   Checksum::change(get16(TCP_SEQ_H_P+2), seq);
+    setSequenceNumber(seq);
+    csum_apply(TCP_CHECKSUM_H_P, sum);
+}
+
+static void make_tcp_segment(uint16_t dlen) {
+    csum_replace(IP_CHECKSUM_P, IP_TOTLEN_H_P, IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen);
+    uint16_t ck = get16(TCP_CHECKSUM_H_P); // of the header alone
+    put16(TCP_CHECKSUM_H_P, Checksum::fold(Checksum::add(EtherCard::tcpOffset(), dlen, (uint16_t) ~ck + dlen)));
     EtherCard::packetSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN);
+    put16(TCP_CHECKSUM_H_P, ck); // for the next segment
 }
 
-void EtherCard::httpServerReply (uint16_t dlen) {
-    make_tcp_ack_from_any(info_data_len,0); // send ack for http get
-    gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V;
-    make_tcp_ack_with_data_noflags(dlen); // send data
+// send data in segments no larger than the peer accepts; PUSH and FIN only go with the last one
+static void make_tcp_ack_with_data_noflags(uint16_t dlen) {
+    uint16_t mss = EtherCard::tcpMss();
+    uint8_t flags = gPB[TCP_FLAGS_P];
+    while (dlen > mss) {
+        tcp_set_flags(flags & ~(TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V));
+        make_tcp_segment(mss);
+        dlen -= mss;
+        memmove(EtherCard::tcpOffset(), EtherCard::tcpOffset() + mss, dlen);
+        tcp_set_seq(getBigEndianLong(TCP_SEQ_H_P) + mss);
+    }
+    tcp_set_flags(flags);
+    make_tcp_segment(dlen);
 }
 
-static uint32_t getBigEndianLong(byte offs) { //get the sequence number of packets after an ack from GET
-    return (((unsigned long)gPB[offs]*256+gPB[offs+1])*256+gPB[offs+2])*256+gPB[offs+3];
-} //thanks to mstuetz for the missing (unsigned long)
+uint16_t EtherCard::tcpMss () {
+    uint16_t mss = bufferSize - TCP_OPTIONS_P;
+    if (mss > peer_mss)
+        mss = peer_mss;
+    return mss < TCP_MSS_MAX ? mss : TCP_MSS_MAX;
+}
 
-static void setSequenceNumber(uint32_t seq) {
-    gPB[TCP_SEQ_H_P]   = (seq & 0xff000000 ) >> 24;
-    gPB[TCP_SEQ_H_P+1] = (seq & 0xff0000 ) >> 16;
-    gPB[TCP_SEQ_H_P+2] = (seq & 0xff00 ) >> 8;
-    gPB[TCP_SEQ_H_P+3] = (seq & 0xff );
+void EtherCard::httpServerReply (uint16_t dlen) {
+    make_tcp_ack_from_any(info_data_len,0); // send ack for http get
+    tcp_set_flags(TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+    make_tcp_ack_with_data_noflags(dlen); // send data
 }
 
 uint32_t EtherCard::getSequenceNumber() {
@@ -305,8 +552,8 @@ void EtherCard::httpServerReplyAck () {
 }
 
 void EtherCard::httpServerReply_with_flags (uint16_t dlen , uint8_t flags) {
-    setSequenceNumber(SEQ);
-    gPB[TCP_FLAGS_P] = flags; // final packet
+    tcp_set_seq(SEQ);
+    tcp_set_flags(flags); // final packet
     make_tcp_ack_with_data_noflags(dlen); // send data
     SEQ=SEQ+dlen;
 }
@@ -381,7 +628,15 @@ void EtherCard::udpPrepare (uint16_t sport, const uint8_t *dip, uint16_t dport)
     }
     // see http://tldp.org/HOWTO/Multicast-HOWTO-2.html
     // multicast or broadcast address, https://github.com/njh/EtherCard/issues/59
-    if ((dip[0] & 0xF0) == 0xE0 || *((unsigned long*) dip) == 0xFFFFFFFF || !memcmp(broadcastip,dip,IP_LEN))
+    if ((dip[0] & 0xF0) == 0xE0) {
+        // 01:00:5E and the low 23 bits of the group address (RFC 1112)
+        gPB[ETH_DST_MAC] = 0x01;
+        gPB[ETH_DST_MAC+1] = 0x00;
+        gPB[ETH_DST_MAC+2] = 0x5E;
+        gPB[ETH_DST_MAC+3] = dip[1] & 0x7F;
+        gPB[ETH_DST_MAC+4] = dip[2];
+        gPB[ETH_DST_MAC+5] = dip[3];
+    } else if (*((unsigned long*) dip) == 0xFFFFFFFF || !memcmp(broadcastip,dip,IP_LEN))
         EtherCard::copyMac(gPB + ETH_DST_MAC, allOnes);
     gPB[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
     gPB[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
@@ -407,13 +662,56 @@ void EtherCard::udpTransmit (uint16_t datalen) {
     packetSend(UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen);
 }
 
-void EtherCard::sendUdp (const char *data, uint8_t datalen, uint16_t sport,
+static void send_udp(const char *data, uint16_t datalen, uint16_t sport,
+                     const uint8_t *dip, uint16_t dport, bool pgm) {
+    EtherCard::udpPrepare(sport, dip, dport);
+    if (datalen > UDP_PAYLOAD_MAX)
+        datalen = UDP_PAYLOAD_MAX;
+    put16(IP_TOTLEN_H_P, IP_HEADER_LEN+UDP_HEADER_LEN+datalen);
+    fill_ip_hdr_checksum();
+    udp_send(data, datalen, pgm);
+}
+
+void EtherCard::sendUdp (const char *data, uint16_t datalen, uint16_t sport,
                          const uint8_t *dip, uint16_t dport) {
-    udpPrepare(sport, dip, dport);
-    if (datalen>220)
-        datalen = 220;
-    memcpy(gPB + UDP_DATA_P, data, datalen);
-    udpTransmit(datalen);
+    send_udp(data, datalen, sport, dip, dport, false);
+}
+
+void EtherCard::sendUdp_P (const char *data PROGMEM, uint16_t datalen, uint16_t sport,
+                           const uint8_t *dip, uint16_t dport) {
+    send_udp(data, datalen, sport, dip, dport, true);
+}
+
+uint8_t EtherCard::sendUdpBatch (UdpBatchEntry *entries, uint8_t count, uint16_t sport) {
+    UdpBatchEntry* prev = 0; // entry whose frame is being transmitted
+    uint8_t sent = 0;
+    for (UdpBatchEntry* e = entries; e < entries + count; ++e) {
+        e->status = -1;
+        if (e->len > bufferSize - UDP_DATA_P)
+            continue;
+        // the headers of the previous frame are still in the buffer, only
+        // a new destination address needs a new MAC address and template
+        if (prev == 0 || memcmp(prev->dip, e->dip, IP_LEN) != 0)
+            udpPrepare(sport, e->dip, e->dport);
+        put16(UDP_DST_PORT_H_P, e->dport);
+        put16(IP_TOTLEN_H_P, IP_HEADER_LEN+UDP_HEADER_LEN+e->len);
+        fill_ip_hdr_checksum();
+        put16(UDP_LEN_H_P, UDP_HEADER_LEN+e->len);
+        put16(UDP_CHECKSUM_H_P, 0);
+        memcpy(gPB + UDP_DATA_P, e->data, e->len);
+        fill_checksum(UDP_CHECKSUM_H_P, IP_SRC_P, 16 + e->len,1);
+        int8_t result = packetSendNext(UDP_DATA_P + e->len);
+        if (prev != 0)
+            sent += (prev->status = result) > 0;
+        prev = e;
+    }
+    if (prev != 0)
+        sent += (prev->status = packetSendWait()) > 0;
+    return sent;
+}
+
+uint16_t EtherCard::udpReadSlice (char *dest, uint16_t maxlen, uint16_t offset) {
+    return readPacketSlice(dest, maxlen, UDP_DATA_P + offset);
 }
 
 void EtherCard::sendWol (uint8_t *wolmac) {
@@ -444,14 +742,18 @@ void EtherCard::sendWol (uint8_t *wolmac) {
 
 // make a arp request
 static void client_arp_whohas(uint8_t *ip_we_search) {
+    EtherCard::arpRequest(ip_we_search, EtherCard::myip);
+}
+
+void EtherCard::arpRequest (const uint8_t *ip, const uint8_t *senderip) {
     setMACs(allOnes);
     gPB[ETH_TYPE_H_P] = ETHTYPE_ARP_H_V;
     gPB[ETH_TYPE_L_P] = ETHTYPE_ARP_L_V;
     memcpy_P(gPB + ETH_ARP_P, arpreqhdr, sizeof arpreqhdr);
     memset(gPB + ETH_ARP_DST_MAC_P, 0, ETH_LEN);
     EtherCard::copyMac(gPB + ETH_ARP_SRC_MAC_P, EtherCard::mymac);
-    EtherCard::copyIp(gPB + ETH_ARP_DST_IP_P, ip_we_search);
-    EtherCard::copyIp(gPB + ETH_ARP_SRC_IP_P, EtherCard::myip);
+    EtherCard::copyIp(gPB + ETH_ARP_DST_IP_P, ip);
+    EtherCard::copyIp(gPB + ETH_ARP_SRC_IP_P, senderip);
     EtherCard::packetSend(42);
 }
 
@@ -461,7 +763,7 @@ uint8_t EtherCard::clientWaitingGw () {
 
 uint8_t EtherCard::clientWaitingDns () {
     if(is_lan(myip, dnsip))
-        return !has_dns_mac;
+        return !has_dns_mac || memcmp(dns_mac_ip, dnsip, IP_LEN) != 0;
     return !(waitgwmac & WGW_HAVE_GW_MAC);
 }
 
@@ -516,10 +818,7 @@ static void client_syn(uint8_t srcport,uint8_t dstport_h,uint8_t dstport_l) {
     gPB[TCP_CHECKSUM_L_P] = 0;
     gPB[TCP_CHECKSUM_L_P+1] = 0;
     gPB[TCP_CHECKSUM_L_P+2] = 0;
-    gPB[TCP_OPTIONS_P] = 2;
-    gPB[TCP_OPTIONS_P+1] = 4;
-    gPB[TCP_OPTIONS_P+2] = (CLIENTMSS>>8);
-    gPB[TCP_OPTIONS_P+3] = (uint8_t) CLIENTMSS;
+    put_mss_option(local_mss());
     fill_checksum(TCP_CHECKSUM_H_P, IP_SRC_P, 8 +TCP_HEADER_LEN_PLAIN+4,2);
     // 4 is the tcp mss option:
     EtherCard::packetSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+ETH_HEADER_LEN+4);
@@ -536,26 +835,301 @@ uint8_t EtherCard::clientTcpReq (uint8_t (*result_cb)(uint8_t,uint8_t,uint16_t,u
     return tcp_fd;
 }
 
+#if ETHERCARD_TCPCLIENT_POOL
+#define CONN_FREE 0
+#define CONN_BUSY 1   // carrying the current request
+#define CONN_REUSED 2 // carrying the current request, sent on a kept-open connection
+#define CONN_IDLE 3   // response complete, kept open for the next request
+#define RESP_HEADERS 0xFFFFFFFFUL // response headers not complete yet
+#define RESP_UNKNOWN 0xFFFFFFFEUL // response length unknown, read up to the server's FIN
+#define HDR_SEEN 0x01   // some of the response arrived
+#define HDR_HTTP11 0x02 // status line starts with HTTP/1.1
+#define HDR_NOBODY 0x04 // status 204 or 304
+#define HDR_LENGTH 0x08 // Content-Length header seen
+#define HDR_CLOSE 0x10  // Connection: close header seen
+#define HDR_VALUE 0x20  // the current line matched, its value follows
+#define TCP_KEEPALIVE_INTERVAL 15000 // ms of silence before an idle connection is probed
+#define TCP_KEEPALIVE_PROBES 3 // unanswered probes before an idle connection is dropped
+
+typedef struct {
+    uint8_t state;
+    uint8_t port_l;          // our source port (LSB)
+    uint8_t fd;              // request id of the current or last request
+    uint8_t probes;          // keepalive probes not answered yet
+    uint8_t ip[IP_LEN];      // server IP address
+    uint8_t mac[ETH_LEN];    // server or gateway MAC address
+    uint16_t port;           // server port
+    uint16_t mss;            // MSS advertised by the server
+    uint32_t snd_nxt;        // next sequence number to send
+    uint32_t rcv_nxt;        // next sequence number expected
+    uint32_t remaining;      // response body bytes still to come, or RESP_*
+    uint32_t length;         // status code, then Content-Length, while reading the headers
+    uint8_t hdr;             // HDR_* flags of the response
+    uint8_t hdr_pos;         // characters seen of the current header line
+    uint8_t hdr_match;       // bits of the hdr_names the current line still matches
+    unsigned long last;      // millis() of last activity
+} TcpConn;
+
+// header line prefixes looked for; the status line is only matched against the first
+static const char hdr_names[][18] PROGMEM = { "HTTP/1.1 ", "Content-Length:", "Connection: close" };
+#define MATCH_STATUS 0x01
+#define MATCH_LENGTH 0x02
+#define MATCH_CLOSE 0x04
+
+static TcpConn tcp_pool[ETHERCARD_TCPCLIENT_POOL];
+static TcpConn* client_conn; // connection of the current request, 0 if not pooled
+static bool http_keep_alive; // see httpKeepAlive()
+
+// find the pooled connection a received segment belongs to
+static TcpConn* pool_find() {
+    uint16_t port = (gPB[TCP_SRC_PORT_H_P] << 8) | gPB[TCP_SRC_PORT_L_P];
+    for (TcpConn* c = tcp_pool; c < tcp_pool + ETHERCARD_TCPCLIENT_POOL; ++c)
+        if (c->state != CONN_FREE && c->port_l == gPB[TCP_DST_PORT_L_P] &&
+                c->port == port && check_ip_message_is_from(c->ip))
+            return c;
+    return 0;
+}
+
+// build the headers of a segment on a pooled connection, without a received packet to answer
+static void conn_head(const TcpConn* c, uint8_t flags, uint32_t seq) {
+    setMACandIPs(c->mac, c->ip);
+    gPB[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
+    gPB[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
+    memcpy_P(gPB + IP_P,iphdr,sizeof iphdr);
+    gPB[IP_PROTO_P] = IP_PROTO_TCP_V;
+    gPB[TCP_SRC_PORT_H_P] = TCPCLIENT_SRC_PORT_H;
+    gPB[TCP_SRC_PORT_L_P] = c->port_l;
+    gPB[TCP_DST_PORT_H_P] = c->port >> 8;
+    gPB[TCP_DST_PORT_L_P] = c->port;
+    setSequenceNumber(seq);
+    setBigEndianLong(TCP_SEQACK_H_P, c->rcv_nxt);
+    gPB[TCP_HEADER_LEN_P] = 0x50;
+    gPB[TCP_FLAGS_P] = flags;
+    gPB[TCP_WIN_SIZE] = 0x4;
+    gPB[TCP_WIN_SIZE+1] = 0;
+    gPB[TCP_CHECKSUM_L_P+1] = 0; // urgent pointer
+    gPB[TCP_CHECKSUM_L_P+2] = 0;
+    gPB[IP_TOTLEN_L_P] = IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN;
+    fill_ip_hdr_checksum();
+    put16(TCP_CHECKSUM_H_P, 0);
+    fill_checksum(TCP_CHECKSUM_H_P, IP_SRC_P, 8+TCP_HEADER_LEN_PLAIN,2); // of the header alone, see make_tcp_ack_from_any()
+    peer_mss = c->mss;
+}
+
+// get ready to read the headers of the response to a new request
+static void pool_expect_response(TcpConn* c) {
+    c->remaining = RESP_HEADERS;
+    c->length = 0;
+    c->hdr = 0;
+    c->hdr_pos = 0;
+    c->hdr_match = MATCH_STATUS;
+}
+
+// send the current request on a kept-open connection to the same server, if there is one
+static bool pool_start_request() {
+    if (client_conn)
+        client_conn->state = CONN_FREE; // previous request abandoned before its response completed
+    client_conn = 0;
+    if (!http_keep_alive)
+        return false;
+    uint16_t port = (tcp_client_port_h << 8) | tcp_client_port_l;
+    for (TcpConn* c = tcp_pool; c < tcp_pool + ETHERCARD_TCPCLIENT_POOL; ++c)
+        if (c->state == CONN_IDLE && c->port == port && memcmp(c->ip, EtherCard::hisip, IP_LEN) == 0) {
+            client_conn = c;
+            c->state = CONN_REUSED;
+            c->fd = tcp_fd;
+            pool_expect_response(c);
+            c->probes = 0;
+            c->last = millis();
+            conn_head(c, TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V, c->snd_nxt);
+            uint16_t len = client_tcp_datafill_cb ? (*client_tcp_datafill_cb)(tcp_fd) : 0;
+            c->snd_nxt += len;
+            make_tcp_ack_with_data_noflags(len);
+            return true;
+        }
+    return false;
+}
+
+// take a pool entry for a connection just opened with a SYN, closing the oldest idle one if needed
+static void pool_open(uint8_t srcport) {
+    if (!http_keep_alive)
+        return;
+    TcpConn* c = 0;
+    for (TcpConn* p = tcp_pool; p < tcp_pool + ETHERCARD_TCPCLIENT_POOL; ++p) {
+        if (p->state != CONN_FREE && p->port_l == srcport) {
+            c = p; // port is being reused, the old connection must go
+            break;
+        }
+        if (c == 0 || (c->state != CONN_FREE && (p->state == CONN_FREE || p->last - c->last > 0x80000000UL)))
+            c = p;
+    }
+    if (c->state == CONN_IDLE) {
+        conn_head(c, TCP_FLAGS_ACK_V|TCP_FLAGS_RST_V, c->snd_nxt);
+        make_tcp_segment(0);
+    } else if (c->state != CONN_FREE)
+        return;
+    client_conn = c;
+    c->state = CONN_BUSY;
+    c->port_l = srcport;
+    c->fd = tcp_fd;
+    c->probes = 0;
+    EtherCard::copyIp(c->ip, EtherCard::hisip);
+    c->port = (tcp_client_port_h << 8) | tcp_client_port_l;
+    c->mss = TCP_MSS_DEFAULT;
+    pool_expect_response(c);
+    c->last = millis();
+}
+
+static void pool_close(TcpConn* c) {
+    c->state = CONN_FREE;
+    if (c == client_conn)
+        client_conn = 0;
+}
+
+// remember where the connection stands after we acknowledged a segment on it
+static void pool_acked(TcpConn* c) {
+    c->snd_nxt = getBigEndianLong(TCP_SEQ_H_P);
+    c->rcv_nxt = getBigEndianLong(TCP_SEQACK_H_P);
+    c->last = millis();
+}
+
+// feed one character of the response headers to the parser; returns true
+// at the empty line that ends them. Lines may span segments.
+static bool http_header_char(TcpConn* c, char ch) {
+    if (ch == '\r')
+        return false;
+    if (ch == '\n') {
+        if (c->hdr_pos == 0)
+            return true;
+        if (c->hdr_match == MATCH_STATUS && (c->length == 204 || c->length == 304))
+            c->hdr |= HDR_NOBODY;
+        c->hdr &= ~HDR_VALUE;
+        c->hdr_pos = 0;
+        c->hdr_match = MATCH_LENGTH | MATCH_CLOSE;
+        return false;
+    }
+    uint8_t pos = c->hdr_pos;
+    if (pos < 255)
+        c->hdr_pos++;
+    if (c->hdr & HDR_VALUE) {
+        if (ch >= '0' && ch <= '9' && (c->hdr_match == MATCH_LENGTH ||
+                (c->hdr_match == MATCH_STATUS && pos < 12))) // status code is characters 9..11
+            c->length = c->length * 10 + (ch - '0');
+        return false;
+    }
+    for (uint8_t i = 0; i < sizeof hdr_names / sizeof hdr_names[0]; ++i) {
+        uint8_t bit = 1 << i;
+        if (!(c->hdr_match & bit))
+            continue;
+        const char* name = hdr_names[i];
+        if (tolower(ch) != tolower(pgm_read_byte(name + pos))) {
+            c->hdr_match &= ~bit;
+        } else if (pgm_read_byte(name + pos + 1) == 0) {
+            c->hdr_match = bit;
+            c->hdr |= HDR_VALUE;
+            c->length = 0;
+            if (bit == MATCH_STATUS)
+                c->hdr |= HDR_HTTP11;
+            else if (bit == MATCH_LENGTH)
+                c->hdr |= HDR_LENGTH;
+            else
+                c->hdr |= HDR_CLOSE;
+            break;
+        }
+    }
+    return false;
+}
+
+// body length announced by the complete response headers
+static uint32_t http_body_length(const TcpConn* c) {
+    if (!(c->hdr & HDR_HTTP11) || (c->hdr & HDR_CLOSE))
+        return RESP_UNKNOWN; // HTTP/1.0 servers close the connection anyway
+    if (c->hdr & HDR_NOBODY)
+        return 0;
+    if (c->hdr & HDR_LENGTH)
+        return c->length;
+    return RESP_UNKNOWN; // chunked
+}
+
+// follow a response segment, of which len bytes are in the buffer
+static void pool_track_response(TcpConn* c, uint16_t pos, uint16_t len, uint16_t seglen) {
+    if (c->remaining == RESP_HEADERS) {
+        const char* p = (const char*) gPB + pos;
+        uint16_t i = 0;
+        c->hdr |= HDR_SEEN;
+        while (i < len && !http_header_char(c, p[i]))
+            ++i;
+        if (i == len) {
+            if (len < seglen)
+                c->remaining = RESP_UNKNOWN; // the rest of the headers did not fit in the buffer
+            return;
+        }
+        seglen -= i + 1;
+        c->remaining = http_body_length(c);
+    }
+    if (c->remaining != RESP_UNKNOWN)
+        c->remaining = seglen < c->remaining ? c->remaining - seglen : 0;
+}
+
+// handle a segment arriving on an idle connection
+static void pool_idle_segment(TcpConn* c, uint16_t len) {
+    c->probes = 0;
+    c->last = millis();
+    if (gPB[TCP_FLAGS_P] & TCP_FLAGS_RST_V)
+        pool_close(c);
+    else if (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) {
+        make_tcp_ack_from_any(len+1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V); // server timed out the connection
+        pool_close(c);
+    } else if (len > 0)
+        make_tcp_ack_from_any(len,0); // retransmission, our ACK got lost
+}
+
+// probe idle connections; a probe is an empty segment at snd_nxt-1, already
+// acknowledged, so the server must answer it with an ACK
+static void pool_keepalive() {
+    for (TcpConn* c = tcp_pool; c < tcp_pool + ETHERCARD_TCPCLIENT_POOL; ++c)
+        if (c->state == CONN_IDLE && millis() - c->last >= TCP_KEEPALIVE_INTERVAL) {
+            if (c->probes == TCP_KEEPALIVE_PROBES) {
+                pool_close(c);
+                continue;
+            }
+            c->probes++;
+            c->last = millis();
+            conn_head(c, TCP_FLAGS_ACK_V, c->snd_nxt - 1);
+            make_tcp_segment(0);
+        }
+}
+#endif
+
+// HTTP/1.1 only when the connection may be kept open for the next request
+static uint16_t http_minor_version() {
+#if ETHERCARD_TCPCLIENT_POOL
+    return http_keep_alive;
+#else
+    return 0;
+#endif
+}
+
 static uint16_t www_client_internal_datafill_cb(uint8_t fd) {
     BufferFiller bfill = EtherCard::tcpOffset();
     if (fd==www_fd) {
         if (client_postval == 0) {
-            bfill.emit_p(PSTR("GET $F$S HTTP/1.0\r\n"
+            bfill.emit_p(PSTR("GET $F$S HTTP/1.$D\r\n"
                               "Host: $F\r\n"
                               "$F\r\n"
                               "\r\n"), client_urlbuf,
-                         client_urlbuf_var,
+                         client_urlbuf_var, http_minor_version(),
                          client_hoststr, client_additionalheaderline);
         } else {
             const char* ahl = client_additionalheaderline;
-            bfill.emit_p(PSTR("POST $F HTTP/1.0\r\n"
+            bfill.emit_p(PSTR("POST $F HTTP/1.$D\r\n"
                               "Host: $F\r\n"
                               "$F$S"
                               "Accept: */*\r\n"
                               "Content-Length: $D\r\n"
                               "Content-Type: application/x-www-form-urlencoded\r\n"
                               "\r\n"
-                              "$S"), client_urlbuf,
+                              "$S"), client_urlbuf, http_minor_version(),
                          client_hoststr,
                          ahl != 0 ? ahl : PSTR(""),
                          ahl != 0 ? "\r\n" : "",
@@ -638,6 +1212,37 @@ void EtherCard::registerPingCallback (void (*callback)(uint8_t *srcip)) {
     icmp_cb = callback;
 }
 
+void EtherCard::registerNetworkCallback (NetworkCallback callback) {
+    network_cb = callback;
+}
+
+void EtherCard::networkEvent (uint8_t event) {
+    if (network_cb)
+        network_cb(event);
+}
+
+// xorshift32, seeded with the MAC address so that every interface has its own sequence
+static uint32_t randomState;
+
+void EtherCard::randomMix (uint32_t seed) {
+    randomBelow(1); // seeds from the MAC address first
+    randomState ^= seed;
+    if (randomState == 0)
+        randomState = 1;
+}
+
+uint16_t EtherCard::randomBelow (uint16_t range) {
+    if (randomState == 0) {
+        for (uint8_t i = 0; i < ETH_LEN; ++i)
+            randomState = (randomState << 5) + randomState + mymac[i];
+        randomState |= 1;
+    }
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState % range;
+}
+
 uint8_t EtherCard::packetLoopIcmpCheckReply (const uint8_t *ip_monitoredhost) {
     return gPB[IP_PROTO_P]==IP_PROTO_ICMP_V &&
            gPB[ICMP_TYPE_P]==ICMP_TYPE_ECHOREPLY_V &&
@@ -652,12 +1257,39 @@ uint16_t EtherCard::accept(const uint16_t port, uint16_t plen) {
             gPB[TCP_DST_PORT_L_P] == ((uint8_t) port))
     {   //Packet targeted at specified port
         if (gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V)
-            make_tcp_synack_from_syn(); //send SYN+ACK
+        {
+#if ETHERCARD_SYNCOOKIES
+            randomMix(micros()); // arrival times of SYNs feed the cookie salts
+#endif
+            if (take_reply_token())
+                make_tcp_synack_from_syn(); //send SYN+ACK
+            else
+            {
+                tcpSynDropped++;
+#if ETHERCARD_SYNCOOKIES
+                syn_flood = true;
+                syn_flood_time = millis();
+#endif
+            }
+        }
         else if (gPB[TCP_FLAGS_P] & TCP_FLAGS_ACK_V)
         {   //This is an acknowledgement to our SYN+ACK so let's start processing that payload
             info_data_len = getTcpPayloadLength();
             if (info_data_len > 0)
             {   //Got some data
+#if ETHERCARD_SYNCOOKIES
+                uint16_t mss = check_cookie(getBigEndianLong(TCP_SEQACK_H_P) - 1);
+                if (mss == 0 && syn_flood && millis() - syn_flood_time < SYN_FLOOD_HOLD)
+                {   //Does not acknowledge a SYN+ACK of ours while SYNs are being dropped
+                    tcpBadCookies++;
+                    if (take_reply_token())
+                        make_tcp_ack_from_any(info_data_len,TCP_FLAGS_RST_V);
+                    return 0;
+                }
+                peer_mss = mss != 0 ? mss : TCP_MSS_DEFAULT; // older connection, its MSS is not known
+#else
+                peer_mss = isn_to_mss(getBigEndianLong(TCP_SEQACK_H_P) - 1);
+#endif
                 pos = TCP_DATA_START; // TCP_DATA_START is a formula
                 //!@todo no idea what this check pos<=plen-8 does; changed this to pos<=plen as otw. perfectly valid tcp packets are ignored; still if anybody has any idea please leave a comment
                 if (pos <= plen)
@@ -676,6 +1308,9 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 #if ETHERCARD_DHCP
     if(using_dhcp) {
         ether.DhcpStateMachine(plen);
+#if ETHERCARD_LINKLOCAL
+        linkLocalStateMachine(plen);
+#endif
     }
 #endif
 
@@ -687,16 +1322,37 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
             waitgwmac |= WGW_ACCEPT_ARP_REPLY;
         }
         delaycnt++;
+#if ETHERCARD_IPFRAG
+        ipFragExpire();
+#endif
 
 #if ETHERCARD_TCPCLIENT
         //Initiate TCP/IP session if pending
         if (tcp_client_state==TCP_STATE_SENDSYN && (waitgwmac & WGW_HAVE_GW_MAC)) { // send a syn
             tcp_client_state = TCP_STATE_SYNSENT;
-            tcpclient_src_port_l++; // allocate a new port
-            client_syn(((tcp_fd<<5) | (0x1f & tcpclient_src_port_l)),tcp_client_port_h,tcp_client_port_l);
+#if ETHERCARD_TCPCLIENT_POOL
+            if (pool_start_request())
+                tcp_client_state = TCP_STATE_ESTABLISHED; // request went out on a kept-open connection
+            else
+#endif
+            {
+                tcpclient_src_port_l++; // allocate a new port
+                uint8_t srcport = (tcp_fd<<5) | (0x1f & tcpclient_src_port_l);
+                client_syn(srcport,tcp_client_port_h,tcp_client_port_l);
+#if ETHERCARD_TCPCLIENT_POOL
+                pool_open(srcport);
+#endif
+            }
         }
+#if ETHERCARD_TCPCLIENT_POOL
+        pool_keepalive();
+#endif
 #endif
 
+        if (memcmp(dns_mac_ip, dnsip, IP_LEN) != 0) {
+            EtherCard::copyIp(dns_mac_ip, dnsip);
+            has_dns_mac = waiting_for_dns_mac = false;
+        }
         //!@todo this is trying to find mac only once. Need some timeout to make another call if first one doesn't succeed.
         if(is_lan(myip, dnsip) && !has_dns_mac && !waiting_for_dns_mac) {
             client_arp_whohas(dnsip);
@@ -709,6 +1365,7 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
             waiting_for_dest_mac = true;
         }
 
+        dnsPoll();
         return 0;
     }
 
@@ -716,8 +1373,12 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
     {   //Service ARP request
         if (gPB[ETH_ARP_OPCODE_L_P]==ETH_ARP_OPCODE_REQ_L_V)
             make_arp_answer_from_request();
-        if (waitgwmac & WGW_ACCEPT_ARP_REPLY && (gPB[ETH_ARP_OPCODE_L_P]==ETH_ARP_OPCODE_REPLY_L_V) && client_store_mac(gwip, gwmacaddr))
+        if (waitgwmac & WGW_ACCEPT_ARP_REPLY && (gPB[ETH_ARP_OPCODE_L_P]==ETH_ARP_OPCODE_REPLY_L_V) && client_store_mac(gwip, gwmacaddr)) {
+            bool first = !(waitgwmac & WGW_HAVE_GW_MAC);
             waitgwmac = WGW_HAVE_GW_MAC;
+            if (first)
+                networkEvent(NET_READY);
+        }
         if (!has_dns_mac && waiting_for_dns_mac && client_store_mac(dnsip, destmacaddr)) {
             has_dns_mac = true;
             waiting_for_dns_mac = false;
@@ -735,6 +1396,16 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
         return 0;
     }
 
+#if ETHERCARD_IPFRAG
+    if ((gPB[IP_FLAGS_P] & 0x3f) || gPB[IP_FLAGS_P+1])
+    {   //More fragments flag or fragment offset set
+        plen = ipReassemble(plen);
+        if (plen == 0)
+            return 0;
+        fill_ip_hdr_checksum();
+    }
+#endif
+
 #if ETHERCARD_ICMP
     if (gPB[IP_PROTO_P]==IP_PROTO_ICMP_V && gPB[ICMP_TYPE_P]==ICMP_TYPE_ECHOREQUEST_V)
     {   //Service ICMP echo request (ping)
@@ -744,6 +1415,10 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
         return 0;
     }
 #endif
+#if ETHERCARD_DNS
+    if (gPB[IP_PROTO_P]==IP_PROTO_UDP_V && dnsHasProcessedPacket(plen))
+        return 0;
+#endif
 #if ETHERCARD_UDPSERVER
     if (ether.udpServerListening() && gPB[IP_PROTO_P]==IP_PROTO_UDP_V)
     {   //Call UDP server handler (callback) if one is defined for this packet
@@ -758,27 +1433,60 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 #if ETHERCARD_TCPCLIENT
     if (gPB[TCP_DST_PORT_H_P]==TCPCLIENT_SRC_PORT_H)
     {   //Source port is in range reserved (by EtherCard) for client TCP/IP connections
+        uint8_t fd = (gPB[TCP_DST_PORT_L_P]>>5)&0x7; // request id is encoded in the port
+        len = getTcpPayloadLength();
+#if ETHERCARD_TCPCLIENT_POOL
+        TcpConn* conn = pool_find();
+        if (conn && conn->state == CONN_IDLE) {
+            pool_idle_segment(conn, len);
+            return 0;
+        }
+        if (conn)
+            fd = conn->fd; // a kept-open connection carries later requests too
+#endif
         if (check_ip_message_is_from(hisip)==0)
             return 0; //Not current TCP/IP connection (only handle one at a time)
         if (gPB[TCP_FLAGS_P] & TCP_FLAGS_RST_V)
         {   //TCP reset flagged
+#if ETHERCARD_TCPCLIENT_POOL
+            if (conn) {
+                bool retry = conn->state == CONN_REUSED && !(conn->hdr & HDR_SEEN);
+                pool_close(conn);
+                if (retry) {
+                    tcp_client_state = TCP_STATE_SENDSYN; // server had dropped the idle connection, reconnect
+                    return 0;
+                }
+            }
+#endif
             if (client_tcp_result_cb)
-                (*client_tcp_result_cb)((gPB[TCP_DST_PORT_L_P]>>5)&0x7,3,0,0);
+                (*client_tcp_result_cb)(fd,3,0,0);
             tcp_client_state = TCP_STATE_CLOSING;
             return 0;
         }
-        len = getTcpPayloadLength();
         if (tcp_client_state==TCP_STATE_SYNSENT)
         {   //Waiting for SYN-ACK
             if ((gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V) && (gPB[TCP_FLAGS_P] &TCP_FLAGS_ACK_V))
             {   //SYN and ACK flags set so this is an acknowledgement to our SYN
+                peer_mss = get_mss_option();
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn) {
+                    copyMac(conn->mac, gPB + ETH_SRC_MAC);
+                    conn->mss = peer_mss;
+                }
+#endif
                 make_tcp_ack_from_any(0,0);
-                gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
+                tcp_set_flags(TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V);
                 if (client_tcp_datafill_cb)
-                    len = (*client_tcp_datafill_cb)((gPB[TCP_SRC_PORT_L_P]>>5)&0x7);
+                    len = (*client_tcp_datafill_cb)(fd);
                 else
                     len = 0;
                 tcp_client_state = TCP_STATE_ESTABLISHED;
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn) {
+                    pool_acked(conn);
+                    conn->snd_nxt += len;
+                }
+#endif
                 make_tcp_ack_with_data_noflags(len);
             }
             else
@@ -787,7 +1495,8 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
                 len++;
                 if (gPB[TCP_FLAGS_P] & TCP_FLAGS_ACK_V)
                     len = 0;
-                make_tcp_ack_from_any(len,TCP_FLAGS_RST_V);
+                if (take_reply_token())
+                    make_tcp_ack_from_any(len,TCP_FLAGS_RST_V);
             }
             return 0;
         }
@@ -800,16 +1509,41 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
                 uint16_t save_len = len;
                 if (tcpstart+len>plen)
                     save_len = plen-tcpstart;
-                (*client_tcp_result_cb)((gPB[TCP_DST_PORT_L_P]>>5)&0x7,0,tcpstart,save_len); //Call TCP handler (callback) function
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn)
+                    pool_track_response(conn, tcpstart, save_len, len);
+#endif
+                (*client_tcp_result_cb)(fd,0,tcpstart,save_len); //Call TCP handler (callback) function
 
-                if(persist_tcp_connection)
+                bool keep = persist_tcp_connection;
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn && (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V))
+                    keep = false; // last segment of a response read up to the server's FIN
+#endif
+                if(keep)
                 {   //Keep connection alive by sending ACK
                     make_tcp_ack_from_any(len,TCP_FLAGS_PUSH_V);
+#if ETHERCARD_TCPCLIENT_POOL
+                    if (conn) {
+                        pool_acked(conn);
+                        if (conn->remaining == 0)
+                        {   //Response complete, keep connection for the next request
+                            conn->state = CONN_IDLE;
+                            conn->probes = 0;
+                            client_conn = 0;
+                            tcp_client_state = TCP_STATE_CLOSED;
+                        }
+                    }
+#endif
                 }
                 else
                 {   //Close connection
                     make_tcp_ack_from_any(len,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
                     tcp_client_state = TCP_STATE_CLOSED;
+#if ETHERCARD_TCPCLIENT_POOL
+                    if (conn)
+                        pool_close(conn);
+#endif
                 }
                 return 0;
             }
@@ -817,11 +1551,29 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
         if (tcp_client_state != TCP_STATE_CLOSING)
         {   //
             if (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) {
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn && conn->state == CONN_REUSED && !(conn->hdr & HDR_SEEN) && len == 0) {
+                    make_tcp_ack_from_any(1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+                    pool_close(conn);
+                    tcp_client_state = TCP_STATE_SENDSYN; // server closed the idle connection as we used it, reconnect
+                    return 0;
+                }
+                if (conn && len == 0 && getBigEndianLong(TCP_SEQ_H_P) == conn->rcv_nxt) {
+                    make_tcp_ack_from_any(1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V); // all data is in, end of the response
+                    pool_close(conn);
+                    tcp_client_state = TCP_STATE_CLOSED;
+                    return 0;
+                }
+#endif
                 if(tcp_client_state == TCP_STATE_ESTABLISHED) {
                     return 0; // In some instances FIN is received *before* DATA.  If that is the case, we just return here and keep looking for the data packet
                 }
                 make_tcp_ack_from_any(len+1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
                 tcp_client_state = TCP_STATE_CLOSED; // connection terminated
+#if ETHERCARD_TCPCLIENT_POOL
+                if (conn)
+                    pool_close(conn);
+#endif
             } else if (len>0) {
                 make_tcp_ack_from_any(len,0);
             }
@@ -839,3 +1591,10 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 void EtherCard::persistTcpConnection(bool persist) {
     persist_tcp_connection = persist;
 }
+
+void EtherCard::httpKeepAlive(bool keep) {
+#if ETHERCARD_TCPCLIENT_POOL
+    http_keep_alive = keep;
+    persist_tcp_connection = keep;
+#endif
+}
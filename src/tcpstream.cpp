@@ -0,0 +1,60 @@
+// Streaming TCP server replies, sent in full-sized segments.
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "EtherCard.h"
+
+void TcpStream::send (uint8_t flags) {
+    EtherCard::httpServerReply_with_flags(fill, flags);
+    fill = 0;
+}
+
+void TcpStream::begin () {
+    fill = 0;
+    EtherCard::httpServerReplyAck();
+}
+
+WRITE_RESULT TcpStream::write (uint8_t v) {
+    EtherCard::tcpOffset()[fill++] = v;
+    if (fill >= EtherCard::tcpMss())
+        send(TCP_FLAGS_ACK_V);
+    WRITE_RETURN
+}
+
+void TcpStream::emit_raw (const char* s, uint16_t n) {
+    while (n > 0) {
+        uint16_t len = EtherCard::tcpMss() - fill;
+        if (len > n)
+            len = n;
+        memcpy(EtherCard::tcpOffset() + fill, s, len);
+        fill += len;
+        s += len;
+        n -= len;
+        if (fill >= EtherCard::tcpMss())
+            send(TCP_FLAGS_ACK_V);
+    }
+}
+
+void TcpStream::emit_raw_p (const char* p PROGMEM, uint16_t n) {
+    while (n > 0) {
+        uint16_t len = EtherCard::tcpMss() - fill;
+        if (len > n)
+            len = n;
+        memcpy_P(EtherCard::tcpOffset() + fill, p, len);
+        fill += len;
+        p += len;
+        n -= len;
+        if (fill >= EtherCard::tcpMss())
+            send(TCP_FLAGS_ACK_V);
+    }
+}
+
+void TcpStream::flush () {
+    if (fill > 0)
+        send(TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V);
+}
+
+void TcpStream::close () {
+    send(TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
+}
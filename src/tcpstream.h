@@ -0,0 +1,82 @@
+/** @file */
+
+#ifndef TcpStream_h
+#define TcpStream_h
+
+#include "EtherCard.h"
+
+
+/** This class streams a TCP server reply in as many segments as needed.
+*
+*   Instead of building the whole reply in ether.tcpOffset() and sending it
+*   with httpServerReply(), output can be printed piece by piece. Small writes
+*   are coalesced in the send buffer and a segment only goes out when it is
+*   full (see EtherCard::tcpMss()), when flush() is called or when the reply
+*   is closed.
+*
+*   The stream works on the request that packetLoop() just returned, so all
+*   data of the request must be parsed before the first byte is written: the
+*   reply overwrites the request payload in the buffer.
+*
+*   # Example
+*   ~~~~~~~~~~~~~{.c}
+*     TcpStream out;
+*
+*     if (ether.packetLoop(ether.packetReceive())) {
+*       out.begin();
+*       out.print(F("HTTP/1.0 200 OK\r\n\r\n"));
+*       for (byte i = 0; i < 100; ++i)
+*         out.println(analogRead(0));
+*       out.close();
+*     }
+*   ~~~~~~~~~~~~~
+*/
+class TcpStream : public Print {
+    uint16_t fill; //!< Number of bytes waiting in the current segment
+
+    /** @brief  Send the pending data as one segment
+    *   @param  flags TCP flags of the segment
+    */
+    void send (uint8_t flags);
+
+public:
+    /** @brief  Empty constructor
+    */
+    TcpStream () : fill (0) {}
+
+    /** @brief  Acknowledge the received request and start a new reply
+    */
+    void begin ();
+
+    /** @brief  Add data to the reply from main memory
+    *   @param  s Pointer to data
+    *   @param  n Number of characters to copy
+    */
+    void emit_raw (const char* s, uint16_t n);
+
+    /** @brief  Add data to the reply from program space
+    *   @param  p Program space pointer
+    *   @param  n Number of characters to copy
+    */
+    void emit_raw_p (const char* p PROGMEM, uint16_t n);
+
+    /** @brief  Get number of bytes not sent yet
+    *   @return <i>uint16_t</i> Bytes pending in the current segment
+    */
+    uint16_t position () const { return fill; }
+
+    /** @brief  Send all pending data now (with PUSH flag)
+    */
+    void flush ();
+
+    /** @brief  Send all pending data and finish the connection (with FIN flag)
+    */
+    void close ();
+
+    /** @brief  Write one byte to the reply
+    *   @param  v Byte to add to reply
+    */
+    virtual WRITE_RESULT write (uint8_t v);
+};
+
+#endif
@@ -0,0 +1,66 @@
+// UDP datagrams to one destination, sent from a cached header template.
+//
+// Copyright: GPL V2
+// See http://www.gnu.org/licenses/gpl.html
+
+#include "EtherCard.h"
+
+void UdpFlow::begin (uint16_t sport, const uint8_t *dip, uint16_t dport) {
+    EtherCard::udpPrepare(sport, dip, dport); // picks the MAC address like sendUdp()
+    uint8_t* buf = EtherCard::buffer;
+    buf[IP_FLAGS_P] = 0x40; // don't fragment
+    buf[IP_FLAGS_P+1] = 0;
+    buf[IP_TTL_P] = 64;
+    buf[IP_TOTLEN_L_P] = 0;
+    buf[IP_CHECKSUM_P] = 0;
+    buf[IP_CHECKSUM_P+1] = 0;
+    memcpy(hdr, buf, sizeof hdr);
+    ipsum = Checksum::add(hdr + IP_P, IP_HEADER_LEN);
+    // addresses and ports are adjacent, lengths are added per datagram
+    udpsum = Checksum::add(hdr + IP_SRC_P, 2*IP_LEN + 4, IP_PROTO_UDP_V);
+}
+
+uint8_t* UdpFlow::payload () {
+    return EtherCard::buffer + UDP_DATA_P;
+}
+
+void UdpFlow::finish (uint16_t len, uint32_t sum, uint16_t head) {
+    uint8_t* buf = EtherCard::buffer;
+    uint16_t udplen = UDP_HEADER_LEN + len;
+    uint16_t totlen = IP_HEADER_LEN + udplen;
+    memcpy(buf, hdr, sizeof hdr);
+    ++id;
+    buf[IP_TOTLEN_H_P] = totlen >> 8;
+    buf[IP_TOTLEN_L_P] = totlen;
+    buf[IP_ID_H_P] = id >> 8;
+    buf[IP_ID_L_P] = id;
+    uint16_t check = Checksum::fold(ipsum + totlen + id);
+    buf[IP_CHECKSUM_P] = check >> 8;
+    buf[IP_CHECKSUM_P+1] = check;
+    buf[UDP_LEN_H_P] = udplen >> 8;
+    buf[UDP_LEN_L_P] = udplen;
+    // the length is in the pseudo header and in the UDP header
+    check = Checksum::fold(sum + udpsum + 2 * (uint32_t) udplen);
+    if (check == 0)
+        check = 0xFFFF; // zero means no checksum (RFC 768)
+    buf[UDP_CHECKSUM_H_P] = check >> 8;
+    buf[UDP_CHECKSUM_L_P] = check;
+    EtherCard::packetSend(ETH_HEADER_LEN + totlen, head);
+}
+
+void UdpFlow::transmit (uint16_t len) {
+    finish(len, Checksum::add(payload(), len), UDP_DATA_P + len);
+}
+
+void UdpFlow::send (const void *data, uint16_t len) {
+    if (len > EtherCard::bufferSize - UDP_DATA_P)
+        len = EtherCard::bufferSize - UDP_DATA_P;
+    memcpy(payload(), data, len);
+    transmit(len);
+}
+
+void UdpFlow::send (Stash& stash) {
+    uint16_t addr = EtherCard::packetAddress(UDP_DATA_P);
+    uint16_t len = stash.copyToEnc(addr, UDP_PAYLOAD_MAX);
+    finish(len, EtherCard::enc_checksum(addr, len), UDP_DATA_P);
+}
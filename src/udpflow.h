@@ -0,0 +1,85 @@
+/** @file */
+
+#ifndef UdpFlow_h
+#define UdpFlow_h
+
+#include "EtherCard.h"
+
+class Stash;
+
+/** This class sends UDP datagrams to one destination with a cached header.
+*
+*   udpPrepare() and udpTransmit() build the Ethernet, IP and UDP headers
+*   from scratch for every datagram and sum them for both checksums. A flow
+*   does that work once in begin() and keeps the finished headers together
+*   with their partial checksums. Each send() only copies the headers into
+*   the buffer and patches lengths, IP identification and checksums, so the
+*   payload is the only data that is summed per datagram.
+*
+*   The destination MAC address is looked up in begin(), like udpPrepare()
+*   does: call begin() again after the gateway MAC address or our own
+*   address changed, e.g. after dhcpSetup().
+*
+*   A flow takes 52 bytes of SRAM. The payload can also come from a Stash.
+*
+*   # Example
+*   ~~~~~~~~~~~~~{.c}
+*     UdpFlow flow;
+*
+*     flow.begin(4000, collector, 4000);
+*     ...
+*     flow.send(&sample, sizeof sample);
+*   ~~~~~~~~~~~~~
+*/
+class UdpFlow {
+    uint8_t hdr[UDP_DATA_P]; //!< Ethernet, IP and UDP header, lengths and checksums zero
+    uint32_t ipsum;          //!< Sum of the IP header template
+    uint32_t udpsum;         //!< Sum of pseudo header and UDP header without lengths
+    uint16_t id;             //!< IP identification of the last datagram
+
+    /** @brief  Fill in the headers and send the datagram
+    *   @param  len Size of payload
+    *   @param  sum Sum of the payload
+    *   @param  head Bytes of the frame to send from the buffer, the rest is already in the enc
+    */
+    void finish (uint16_t len, uint32_t sum, uint16_t head);
+
+public:
+    /** @brief  Empty constructor
+    */
+    UdpFlow () : ipsum (0), udpsum (0), id (0) {}
+
+    /** @brief  Build the headers for a destination
+    *   @param  sport Source port
+    *   @param  dip Pointer to 4 byte destination IP address
+    *   @param  dport Destination port
+    *   @note   Overwrites the packet buffer
+    */
+    void begin (uint16_t sport, const uint8_t *dip, uint16_t dport);
+
+    /** @brief  Get room for the payload of the next datagram
+    *   @return <i>uint8_t*</i> Pointer to the payload area in the packet buffer
+    */
+    static uint8_t* payload ();
+
+    /** @brief  Send a datagram whose payload was written to payload()
+    *   @param  len Size of payload
+    */
+    void transmit (uint16_t len);
+
+    /** @brief  Send a datagram
+    *   @param  data Pointer to data
+    *   @param  len Size of payload, truncated to what fits into the packet buffer
+    */
+    void send (const void *data, uint16_t len);
+
+    /** @brief  Send the content of a Stash as a datagram
+    *   @param  stash Stash with the payload, up to 1472 bytes
+    *   @note   The payload is copied from the Stash pages to the transmit buffer by the
+    *           DMA engine of the ENC28J60 and summed by its checksum engine, so it never
+    *           passes through SRAM and may be larger than the packet buffer.
+    */
+    void send (Stash& stash);
+};
+
+#endif
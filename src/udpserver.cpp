@@ -10,64 +10,256 @@
 
 #define gPB ether.buffer
 
-#define UDPSERVER_MAXLISTENERS 8    //the maximum number of port listeners.
-
 typedef struct {
     UdpServerCallback callback;
-    uint16_t port;
+    uint16_t first;         // lowest port of the listener
+    uint16_t last;          // highest port, same as first for a single port
     bool listening;
+    UdpListenerStats stats;
 } UdpServerListener;
 
-UdpServerListener listeners[UDPSERVER_MAXLISTENERS];
-byte numListeners = 0;
+// Listeners are kept sorted by port and their ranges do not overlap, so the
+// one for a port is found with a binary search. The wildcard listener gets
+// whatever no other listener takes.
+static UdpServerListener listeners[ETHERCARD_UDPSERVER_LISTENERS];
+static uint8_t numListeners = 0;
+static UdpServerListener wildcard;
+
+#if ETHERCARD_UDPSERVER_QUEUES
+// A queue parks the datagrams of one listener in enc memory until they are
+// read with udpServerRecvFrom(). Each slot holds a record header followed by
+// the payload, copied from the receive buffer by the DMA engine. enc memory
+// cannot be freed, so the slots of a removed queue are kept for the next one.
+typedef struct {
+    uint16_t port;          // first port of the listener
+    bool any;               // of the wildcard listener instead
+    uint16_t addr;          // enc address of the slots
+    uint16_t bytes;         // size of the block at addr
+    uint16_t slot;          // bytes per slot, record header included
+    uint8_t depth;          // number of slots, 0 if unused
+    uint8_t head;           // oldest datagram
+    uint8_t count;          // datagrams waiting
+} UdpQueue;
+
+typedef struct {
+    uint8_t src_ip[IP_LEN];
+    uint16_t src_port;
+    uint16_t dest_port;
+    uint16_t len;           // payload bytes stored
+} UdpQueueRecord;
+
+static UdpQueue queues[ETHERCARD_UDPSERVER_QUEUES];
+
+static UdpQueue* find_queue(const UdpServerListener* l) {
+    bool any = l == &wildcard;
+    for (UdpQueue* q = queues; q < queues + ETHERCARD_UDPSERVER_QUEUES; ++q)
+        if (q->depth != 0 && q->port == l->first && q->any == any)
+            return q;
+    return 0;
+}
+
+static bool enqueue(UdpQueue* q, uint16_t port, uint16_t datalen) {
+    if (q->count >= q->depth)
+        return false; // drop tail
+    UdpQueueRecord r;
+    EtherCard::copyIp(r.src_ip, gPB + IP_SRC_P);
+    r.src_port = (gPB[UDP_SRC_PORT_H_P] << 8) | gPB[UDP_SRC_PORT_L_P];
+    r.dest_port = port;
+    r.len = datalen < q->slot - sizeof r ? datalen : q->slot - sizeof r;
+    uint16_t addr = q->addr + ((q->head + q->count) % q->depth) * q->slot;
+    EtherCard::memcpy_to_enc(addr, &r, sizeof r);
+    EtherCard::packetSliceToEnc(addr + sizeof r, UDP_DATA_P, r.len);
+    q->count++;
+    return true;
+}
+#endif
 
-void EtherCard::udpServerListenOnPort(UdpServerCallback callback, uint16_t port) {
-    if(numListeners < UDPSERVER_MAXLISTENERS)
-    {
-        listeners[numListeners] = (UdpServerListener) {
-            callback, port, true
-        };
-        numListeners++;
+// index of the first listener whose range ends at or above port
+static uint8_t lower_bound(uint16_t port) {
+    uint8_t lo = 0, hi = numListeners;
+    while (lo < hi) {
+        uint8_t mid = (lo + hi) / 2;
+        if (listeners[mid].last < port)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
+
+// listener whose port or range covers port, not counting the wildcard
+static UdpServerListener* find_port(uint16_t port) {
+    uint8_t i = lower_bound(port);
+    if (i < numListeners && listeners[i].first <= port)
+        return &listeners[i];
+    return 0;
+}
+
+static UdpServerListener* find_listener(uint16_t port) {
+    UdpServerListener* l = find_port(port);
+    if (l == 0 && wildcard.callback != 0)
+        l = &wildcard;
+    return l;
+}
+
+bool EtherCard::udpServerListenOnPortRange(UdpServerCallback callback, uint16_t first, uint16_t last) {
+    if (first > last || numListeners >= ETHERCARD_UDPSERVER_LISTENERS)
+        return false;
+    uint8_t i = lower_bound(first);
+    if (i < numListeners && listeners[i].first <= last)
+        return false; // overlaps an existing listener
+    memmove(listeners + i + 1, listeners + i, (numListeners - i) * sizeof *listeners);
+    memset(listeners + i, 0, sizeof *listeners);
+    listeners[i].callback = callback;
+    listeners[i].first = first;
+    listeners[i].last = last;
+    listeners[i].listening = true;
+    numListeners++;
+    return true;
+}
+
+bool EtherCard::udpServerListenOnPort(UdpServerCallback callback, uint16_t port) {
+    return udpServerListenOnPortRange(callback, port, port);
+}
+
+void EtherCard::udpServerListenOnAnyPort(UdpServerCallback callback) {
+#if ETHERCARD_UDPSERVER_QUEUES
+    UdpQueue* q = find_queue(&wildcard);
+    if (q != 0 && callback == 0)
+        q->depth = 0;
+#endif
+    memset(&wildcard, 0, sizeof wildcard);
+    wildcard.callback = callback;
+    wildcard.last = 0xFFFF;
+    wildcard.listening = callback != 0;
+}
+
+bool EtherCard::udpServerStopListenOnPort(uint16_t port) {
+    UdpServerListener* l = find_port(port);
+    if (l == 0)
+        return false;
+    uint8_t i = l - listeners;
+#if ETHERCARD_UDPSERVER_QUEUES
+    UdpQueue* q = find_queue(l);
+    if (q != 0)
+        q->depth = 0;
+#endif
+    numListeners--;
+    memmove(listeners + i, listeners + i + 1, (numListeners - i) * sizeof *listeners);
+    return true;
 }
 
 void EtherCard::udpServerPauseListenOnPort(uint16_t port) {
-    for(int i = 0; i < numListeners; i++)
-    {
-        if(gPB[UDP_DST_PORT_H_P] == (listeners[i].port >> 8) && gPB[UDP_DST_PORT_L_P] == ((byte) listeners[i].port)) {
-            listeners[i].listening = false;
-        }
-    }
+    UdpServerListener* l = find_port(port);
+    if (l != 0)
+        l->listening = false;
 }
 
 void EtherCard::udpServerResumeListenOnPort(uint16_t port) {
-    for(int i = 0; i < numListeners; i++)
-    {
-        if(gPB[UDP_DST_PORT_H_P] == (listeners[i].port >> 8) && gPB[UDP_DST_PORT_L_P] == ((byte) listeners[i].port)) {
-            listeners[i].listening = true;
+    UdpServerListener* l = find_port(port);
+    if (l != 0)
+        l->listening = true;
+}
+
+const UdpListenerStats* EtherCard::udpServerStats(uint16_t port) {
+    UdpServerListener* l = find_listener(port);
+    return l != 0 ? &l->stats : 0;
+}
+
+#if ETHERCARD_UDPSERVER_QUEUES
+bool EtherCard::udpServerQueueOnPort(uint16_t port, uint8_t depth, uint16_t size) {
+    UdpServerListener* l = find_listener(port);
+    if (l == 0 || depth == 0 || find_queue(l) != 0)
+        return false;
+    uint16_t slot = sizeof (UdpQueueRecord) + size;
+    uint32_t bytes = (uint32_t) slot * depth;
+    UdpQueue* q = 0;
+    for (UdpQueue* u = queues; u < queues + ETHERCARD_UDPSERVER_QUEUES; ++u) {
+        if (u->depth != 0)
+            continue;
+        if (u->bytes >= bytes) {
+            q = u; // the slots of a removed queue are large enough
+            break;
         }
+        if (q == 0)
+            q = u;
+    }
+    if (q == 0 || bytes > 0xFFFF)
+        return false;
+    if (q->bytes < bytes) {
+        uint16_t addr = enc_malloc(bytes);
+        if (addr == 0)
+            return false; // see ENC_HEAP_START in enc28j60.h
+        q->addr = addr;
+        q->bytes = bytes;
     }
+    q->port = l->first;
+    q->any = l == &wildcard;
+    q->slot = slot;
+    q->depth = depth;
+    q->head = 0;
+    q->count = 0;
+    return true;
+}
+
+uint8_t EtherCard::udpServerQueued(uint16_t port) {
+    UdpServerListener* l = find_listener(port);
+    UdpQueue* q = l != 0 ? find_queue(l) : 0;
+    return q != 0 ? q->count : 0;
 }
 
+int16_t EtherCard::udpServerRecvFrom(uint16_t port, char *data, uint16_t maxlen,
+                                     uint8_t *src_ip, uint16_t *src_port, uint16_t *dest_port) {
+    UdpServerListener* l = find_listener(port);
+    UdpQueue* q = l != 0 ? find_queue(l) : 0;
+    if (q == 0 || q->count == 0)
+        return -1;
+    uint16_t addr = q->addr + q->head * q->slot;
+    UdpQueueRecord r;
+    memcpy_from_enc(&r, addr, sizeof r);
+    uint16_t n = r.len < maxlen ? r.len : maxlen;
+    memcpy_from_enc(data, addr + sizeof r, n);
+    if (src_ip != 0)
+        copyIp(src_ip, r.src_ip);
+    if (src_port != 0)
+        *src_port = r.src_port;
+    if (dest_port != 0)
+        *dest_port = r.dest_port;
+    q->head = (q->head + 1) % q->depth;
+    q->count--;
+    return n;
+}
+#endif
+
 bool EtherCard::udpServerListening() {
-    return numListeners > 0;
+    return numListeners > 0 || wildcard.callback != 0;
 }
 
 bool EtherCard::udpServerHasProcessedPacket(uint16_t plen) {
-    bool packetProcessed = false;
-    for(int i = 0; i < numListeners; i++)
-    {
-        if(gPB[UDP_DST_PORT_H_P] == (listeners[i].port >> 8) && gPB[UDP_DST_PORT_L_P] == ((byte) listeners[i].port) && listeners[i].listening)
-        {
-            uint16_t datalen = (uint16_t) (gPB[UDP_LEN_H_P] << 8)  + gPB[UDP_LEN_L_P] - UDP_HEADER_LEN;
-            listeners[i].callback(
-                listeners[i].port,
-                gPB + IP_SRC_P,
-                (gPB[UDP_SRC_PORT_H_P] << 8) | gPB[UDP_SRC_PORT_L_P],
-                (const char *) (gPB + UDP_DATA_P),
-                datalen);
-            packetProcessed = true;
-        }
+    uint16_t port = (gPB[UDP_DST_PORT_H_P] << 8) | gPB[UDP_DST_PORT_L_P];
+    UdpServerListener* l = find_listener(port);
+    if (l == 0)
+        return false;
+    uint16_t datalen = (uint16_t) (gPB[UDP_LEN_H_P] << 8)  + gPB[UDP_LEN_L_P] - UDP_HEADER_LEN;
+    if (!l->listening) {
+        l->stats.drops++;
+        return false;
+    }
+#if ETHERCARD_UDPSERVER_QUEUES
+    UdpQueue* q = find_queue(l);
+    if (q != 0 && !enqueue(q, port, datalen)) {
+        l->stats.drops++;
+        return true;
     }
-    return packetProcessed;
+#endif
+    l->stats.packets++;
+    l->stats.bytes += datalen;
+    if (l->callback != 0)
+        l->callback(
+            port,
+            gPB + IP_SRC_P,
+            (gPB[UDP_SRC_PORT_H_P] << 8) | gPB[UDP_SRC_PORT_L_P],
+            (const char *) (gPB + UDP_DATA_P),
+            datalen);
+    return true;
 }